@@ -0,0 +1,405 @@
+/* Microbenchmarks for the queue operations declared in queue.h */
+
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "bench.h"
+#include "list.h"
+#include "timing.h"
+
+/* Our program needs to use regular malloc/free */
+#define INTERNAL 1
+#include "harness.h"
+
+#include "queue.h"
+
+/* Number of runs thrown away before sampling starts */
+#define BENCH_WARMUP 3
+
+/* Number of sampled runs for each (operation, size) pair */
+#define BENCH_REPS 21
+
+/* Number of samples trimmed from each end of the sorted samples */
+#define BENCH_TRIM 2
+
+/* Length of the strings stored in benchmark queues */
+#define BENCH_STRLEN 8
+
+/* Number of queues merged by the merge benchmark */
+#define BENCH_MERGE_WAYS 4
+
+/* Group size used by the reverseK benchmark */
+#define BENCH_K 3
+
+/* Cheap operations are repeated until a sample covers this many elements */
+#define BENCH_MIN_WORK 4096
+
+static const int bench_sizes[] = {16, 256, 4096, 65536};
+#define N_BENCH_SIZES (sizeof(bench_sizes) / sizeof(bench_sizes[0]))
+
+/* State shared by the setup, run and teardown steps of one sample */
+typedef struct {
+    int n;                     /* Number of elements */
+    struct list_head *q;       /* Queue under test */
+    struct list_head chain;    /* Chain of queues, used by merge only */
+    queue_contex_t ctx[BENCH_MERGE_WAYS];
+    element_t **removed;       /* Elements removed while timing */
+    int n_removed;
+} bench_ctx_t;
+
+typedef struct {
+    char *name;
+    /* Build the input.  Not timed */
+    void (*setup)(bench_ctx_t *b);
+    /* Exercise the operation.  Return the number of operations performed */
+    size_t (*run)(bench_ctx_t *b);
+    /* Release everything built by setup and run.  Not timed */
+    void (*teardown)(bench_ctx_t *b);
+} bench_op_t;
+
+static char (*pool)[BENCH_STRLEN + 1] = NULL;
+static char (*sorted_pool)[BENCH_STRLEN + 1] = NULL;
+
+/* Fixed-seed generator so that every run benchmarks the same input */
+static uint64_t bench_seed = 0x9e3779b97f4a7c15ULL;
+
+static uint64_t bench_rand(void)
+{
+    bench_seed ^= bench_seed << 13;
+    bench_seed ^= bench_seed >> 7;
+    bench_seed ^= bench_seed << 17;
+    return bench_seed;
+}
+
+static bool fill_pools(int n)
+{
+    static const char charset[] = "abcdefghijklmnopqrstuvwxyz";
+
+    pool = malloc(n * sizeof(*pool));
+    sorted_pool = malloc(n * sizeof(*sorted_pool));
+    if (!pool || !sorted_pool)
+        return false;
+
+    for (int i = 0; i < n; i++) {
+        for (int j = 0; j < BENCH_STRLEN; j++)
+            pool[i][j] = charset[bench_rand() % (sizeof(charset) - 1)];
+        pool[i][BENCH_STRLEN] = '\0';
+        /* Every value appears twice, which gives dedup something to do */
+        snprintf(sorted_pool[i], BENCH_STRLEN + 1, "%0*d", BENCH_STRLEN,
+                 i / 2);
+    }
+    return true;
+}
+
+static void free_pools(void)
+{
+    free(pool);
+    free(sorted_pool);
+    pool = sorted_pool = NULL;
+}
+
+/* Setup steps */
+
+static void setup_empty(bench_ctx_t *b)
+{
+    b->q = q_new();
+}
+
+static void setup_random(bench_ctx_t *b)
+{
+    b->q = q_new();
+    for (int i = 0; i < b->n; i++)
+        q_insert_tail(b->q, pool[i]);
+}
+
+static void setup_sorted(bench_ctx_t *b)
+{
+    b->q = q_new();
+    for (int i = 0; i < b->n; i++)
+        q_insert_tail(b->q, sorted_pool[i]);
+}
+
+static void setup_remove(bench_ctx_t *b)
+{
+    setup_random(b);
+    b->removed = malloc(b->n * sizeof(element_t *));
+    b->n_removed = 0;
+}
+
+static void setup_chain(bench_ctx_t *b)
+{
+    INIT_LIST_HEAD(&b->chain);
+    for (int i = 0; i < BENCH_MERGE_WAYS; i++) {
+        b->ctx[i].q = q_new();
+        b->ctx[i].size = 0;
+        b->ctx[i].id = i;
+        list_add_tail(&b->ctx[i].chain, &b->chain);
+    }
+    /* Deal out sorted values round-robin so that every queue is sorted */
+    for (int i = 0; i < b->n; i++) {
+        queue_contex_t *ctx = &b->ctx[i % BENCH_MERGE_WAYS];
+        q_insert_tail(ctx->q, sorted_pool[i]);
+        ctx->size++;
+    }
+}
+
+/* Teardown steps */
+
+static void teardown_queue(bench_ctx_t *b)
+{
+    q_free(b->q);
+    b->q = NULL;
+}
+
+static void teardown_remove(bench_ctx_t *b)
+{
+    for (int i = 0; i < b->n_removed; i++)
+        q_release_element(b->removed[i]);
+    free(b->removed);
+    b->removed = NULL;
+    teardown_queue(b);
+}
+
+static void teardown_chain(bench_ctx_t *b)
+{
+    for (int i = 0; i < BENCH_MERGE_WAYS; i++)
+        q_free(b->ctx[i].q);
+}
+
+/* Timed steps */
+
+static size_t run_insert_head(bench_ctx_t *b)
+{
+    for (int i = 0; i < b->n; i++)
+        q_insert_head(b->q, pool[i]);
+    return b->n;
+}
+
+static size_t run_insert_tail(bench_ctx_t *b)
+{
+    for (int i = 0; i < b->n; i++)
+        q_insert_tail(b->q, pool[i]);
+    return b->n;
+}
+
+static size_t run_remove_head(bench_ctx_t *b)
+{
+    for (int i = 0; i < b->n; i++) {
+        element_t *e = q_remove_head(b->q, NULL, 0);
+        if (e)
+            b->removed[b->n_removed++] = e;
+    }
+    return b->n;
+}
+
+static size_t run_remove_tail(bench_ctx_t *b)
+{
+    for (int i = 0; i < b->n; i++) {
+        element_t *e = q_remove_tail(b->q, NULL, 0);
+        if (e)
+            b->removed[b->n_removed++] = e;
+    }
+    return b->n;
+}
+
+/* Number of back-to-back calls for operations that can be repeated */
+static size_t inner_reps(const bench_ctx_t *b)
+{
+    return b->n >= BENCH_MIN_WORK ? 1 : BENCH_MIN_WORK / b->n;
+}
+
+static size_t run_size(bench_ctx_t *b)
+{
+    size_t reps = inner_reps(b);
+    for (size_t i = 0; i < reps; i++)
+        q_size(b->q);
+    return reps;
+}
+
+static size_t run_reverse(bench_ctx_t *b)
+{
+    size_t reps = inner_reps(b);
+    for (size_t i = 0; i < reps; i++)
+        q_reverse(b->q);
+    return reps;
+}
+
+static size_t run_reverseK(bench_ctx_t *b)
+{
+    size_t reps = inner_reps(b);
+    for (size_t i = 0; i < reps; i++)
+        q_reverseK(b->q, BENCH_K);
+    return reps;
+}
+
+static size_t run_swap(bench_ctx_t *b)
+{
+    size_t reps = inner_reps(b);
+    for (size_t i = 0; i < reps; i++)
+        q_swap(b->q);
+    return reps;
+}
+
+static size_t run_dm(bench_ctx_t *b)
+{
+    q_delete_mid(b->q);
+    return 1;
+}
+
+static size_t run_dedup(bench_ctx_t *b)
+{
+    q_delete_dup(b->q);
+    return 1;
+}
+
+static size_t run_ascend(bench_ctx_t *b)
+{
+    q_ascend(b->q);
+    return 1;
+}
+
+static size_t run_descend(bench_ctx_t *b)
+{
+    q_descend(b->q);
+    return 1;
+}
+
+static size_t run_sort(bench_ctx_t *b)
+{
+    q_sort(b->q, false);
+    return 1;
+}
+
+static size_t run_merge(bench_ctx_t *b)
+{
+    q_merge(&b->chain, false);
+    return 1;
+}
+
+static const bench_op_t bench_ops[] = {
+    {"ih", setup_empty, run_insert_head, teardown_queue},
+    {"it", setup_empty, run_insert_tail, teardown_queue},
+    {"rh", setup_remove, run_remove_head, teardown_remove},
+    {"rt", setup_remove, run_remove_tail, teardown_remove},
+    {"size", setup_random, run_size, teardown_queue},
+    {"reverse", setup_random, run_reverse, teardown_queue},
+    {"reverseK", setup_random, run_reverseK, teardown_queue},
+    {"swap", setup_random, run_swap, teardown_queue},
+    {"dm", setup_random, run_dm, teardown_queue},
+    {"dedup", setup_sorted, run_dedup, teardown_queue},
+    {"ascend", setup_random, run_ascend, teardown_queue},
+    {"descend", setup_random, run_descend, teardown_queue},
+    {"sort", setup_random, run_sort, teardown_queue},
+    {"merge", setup_chain, run_merge, teardown_chain},
+};
+#define N_BENCH_OPS (sizeof(bench_ops) / sizeof(bench_ops[0]))
+
+/* Two-sided 95% critical values of Student's t distribution */
+static double t_critical(int df)
+{
+    static const double table[] = {
+        12.706, 4.303, 3.182, 2.776, 2.571, 2.447, 2.365, 2.306,
+        2.262,  2.228, 2.201, 2.179, 2.160, 2.145, 2.131, 2.120,
+        2.110,  2.101, 2.093, 2.086, 2.080, 2.074, 2.069, 2.064,
+        2.060,  2.056, 2.052, 2.048, 2.045, 2.042,
+    };
+    if (df < 1)
+        return 0;
+    if (df <= sizeof(table) / sizeof(table[0]))
+        return table[df - 1];
+    return 1.960;
+}
+
+static int cmp_double(const void *a, const void *b)
+{
+    double x = *(const double *) a, y = *(const double *) b;
+    return (x > y) - (x < y);
+}
+
+typedef struct {
+    double mean;
+    double ci; /* Half width of the 95% confidence interval */
+} bench_stat_t;
+
+/* Sort the samples, drop BENCH_TRIM from each end and summarize the rest */
+static bench_stat_t summarize(double *samples, int cnt)
+{
+    bench_stat_t st = {0, 0};
+    qsort(samples, cnt, sizeof(double), cmp_double);
+    samples += BENCH_TRIM;
+    cnt -= 2 * BENCH_TRIM;
+
+    for (int i = 0; i < cnt; i++)
+        st.mean += samples[i];
+    st.mean /= cnt;
+
+    double ss = 0;
+    for (int i = 0; i < cnt; i++)
+        ss += (samples[i] - st.mean) * (samples[i] - st.mean);
+    if (cnt > 1)
+        st.ci = t_critical(cnt - 1) * sqrt(ss / (cnt - 1)) / sqrt(cnt);
+    return st;
+}
+
+static void bench_one(const bench_op_t *op, int n)
+{
+    double ns[BENCH_REPS], cycles[BENCH_REPS];
+
+    for (int r = -BENCH_WARMUP; r < BENCH_REPS; r++) {
+        bench_ctx_t b = {.n = n};
+        op->setup(&b);
+
+        timing_t start = timing_now();
+        size_t ops = op->run(&b);
+        timing_t t = timing_since(start);
+
+        op->teardown(&b);
+        if (r < 0)
+            continue;
+        ns[r] = (double) t.ns / ops;
+        cycles[r] = (double) t.cycles / ops;
+    }
+
+    bench_stat_t ns_st = summarize(ns, BENCH_REPS);
+    bench_stat_t cycles_st = summarize(cycles, BENCH_REPS);
+    printf("%-10s %8d %12.1f +- %-10.1f %12.1f +- %-10.1f\n", op->name, n,
+           ns_st.mean, ns_st.ci, cycles_st.mean, cycles_st.ci);
+}
+
+bool bench_run(void)
+{
+    int max_n = bench_sizes[N_BENCH_SIZES - 1];
+    if (!fill_pools(max_n)) {
+        free_pools();
+        fprintf(stderr, "Could not allocate benchmark strings\n");
+        return false;
+    }
+
+    /* Freeing a big queue in cautious mode is quadratic */
+    set_cautious_mode(false);
+
+    printf("Cycle counter runs at %.3f GHz\n", 1 / timing_ns_per_cycle());
+    printf("%-10s %8s %26s %26s\n", "operation", "size", "ns/op (95% CI)",
+           "cycles/op (95% CI)");
+    for (size_t i = 0; i < N_BENCH_OPS; i++) {
+        for (size_t j = 0; j < N_BENCH_SIZES; j++)
+            bench_one(&bench_ops[i], bench_sizes[j]);
+    }
+
+    set_cautious_mode(true);
+    free_pools();
+
+    bool ok = !error_check();
+    size_t bcnt = allocation_check();
+    if (bcnt > 0) {
+        printf("ERROR: Benchmarks finished, but %zu blocks are still "
+               "allocated\n",
+               bcnt);
+        ok = false;
+    }
+    return ok;
+}
@@ -0,0 +1,19 @@
+#ifndef LAB0_BENCH_H
+#define LAB0_BENCH_H
+
+#include <stdbool.h>
+
+/* Microbenchmarks for every queue operation declared in queue.h.
+ *
+ * Each operation is run over a matrix of queue sizes.  For every (operation,
+ * size) pair, a few warmup runs are discarded, the remaining samples are
+ * trimmed at both ends, and the mean cost per operation is reported in
+ * nanoseconds and CPU cycles together with a 95% confidence interval.
+ */
+
+/* Run the whole benchmark matrix and print the results.
+ * Return false if the queue implementation leaked or corrupted memory.
+ */
+bool bench_run(void);
+
+#endif /* LAB0_BENCH_H */
@@ -3,18 +3,21 @@
 #include "console.h"
 #include <ctype.h>
 #include <fcntl.h>
+#include <inttypes.h>
 #include <limits.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <sys/select.h>
 #include <sys/stat.h>
 #include <time.h>
 #include <unistd.h>
 #include "agents/mcts.h"
 #include "game.h"
+#include "metrics.h"
 #include "report.h"
+#include "timing.h"
 #include "web.h"
 /* Some global values */
 int simulation = 0;
@@ -30,6 +33,7 @@ static int move_record[N_GRIDS];
 static int move_count = 0;
 /* Time of day */
 static double first_time, last_time;
+static count_func_t element_count = NULL;
 
 /* Implement buffered I/O using variant of RIO package from CS:APP
  * Must create stack of buffers to handle I/O with nested source commands.
@@ -48,12 +52,17 @@ typedef struct __rio {
 static rio_t *buf_stack;
 static char linebuf[RIO_BUFSIZE];
 
+/* Waits for command input, web clients and timers */
+static event_loop_t *cmd_loop = NULL;
+
 /* Maximum file descriptor */
 static int fd_max = 0;
 
 /* Parameters */
 static int err_limit = 5;
 static int err_cnt = 0;
+/* Errors that the commands are meant to make, as traces of error paths do */
+static int err_expected = 0;
 static int echo = 0;
 
 static bool quit_flag = false;
@@ -67,12 +76,100 @@ static bool has_infile = false;
 static cmd_func_t quit_helpers[MAXQUIT];
 static int quit_helper_cnt = 0;
 
+/* Maximum number of web routes */
+#define MAXROUTES 10
+static web_route_t web_routes[MAXROUTES];
+static int web_route_cnt = 0;
+
 static void init_in();
 
 static bool push_file(char *fname);
 static void pop_file();
+static bool is_compiled(const char *fname);
+static bool run_compiled(const char *fname);
+static void input_ready(int fd, int events, void *arg);
+static void web_cmd(char *cmd, web_response_t *resp);
+static void free_downloads();
 
 static bool interpret_cmda(int argc, char *argv[]);
+static bool do_compile(int argc, char *argv[]);
+
+/* Commands and parameters are kept in sorted lists for listing, and are
+ * looked up by name through open addressing hash tables.
+ */
+typedef struct {
+    const char *name;
+    void *ele;
+} name_slot_t;
+
+typedef struct {
+    name_slot_t *slots;
+    size_t size; /* Power of 2, or 0 before the first insertion */
+    size_t cnt;
+} name_table_t;
+
+static name_table_t cmd_table, param_table;
+
+/* FNV-1a */
+static size_t name_hash(const char *name)
+{
+    uint32_t h = 2166136261u;
+    while (*name) {
+        h ^= (unsigned char) *name++;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+/* Return the slot holding name, or the empty slot where it belongs */
+static name_slot_t *name_slot(const name_table_t *t, const char *name)
+{
+    size_t mask = t->size - 1;
+    size_t i = name_hash(name) & mask;
+    while (t->slots[i].name && strcmp(t->slots[i].name, name) != 0)
+        i = (i + 1) & mask;
+    return &t->slots[i];
+}
+
+static void *name_find(const name_table_t *t, const char *name)
+{
+    if (!t->cnt)
+        return NULL;
+    return name_slot(t, name)->ele;
+}
+
+static void name_free(name_table_t *t)
+{
+    if (t->slots)
+        free_array(t->slots, t->size, sizeof(name_slot_t));
+    t->slots = NULL;
+    t->size = t->cnt = 0;
+}
+
+/* Map name to ele, replacing any previous mapping of name */
+static void name_insert(name_table_t *t, const char *name, void *ele)
+{
+    /* Keep the load factor at most 1/2 */
+    if (2 * (t->cnt + 1) > t->size) {
+        name_table_t old = *t;
+        t->size = old.size ? 2 * old.size : 64;
+        t->cnt = 0;
+        t->slots = calloc_or_fail(t->size, sizeof(name_slot_t), "name_insert");
+        for (size_t i = 0; i < old.size; i++) {
+            if (old.slots[i].name)
+                name_insert(t, old.slots[i].name, old.slots[i].ele);
+        }
+        name_free(&old);
+    }
+
+    name_slot_t *slot = name_slot(t, name);
+    if (!slot->name) {
+        slot->name = name;
+        t->cnt++;
+    }
+    slot->ele = ele;
+}
+
 static void record_move(int move)
 {
     move_record[move_count++] = move;
@@ -92,8 +189,13 @@ void add_cmd(char *name, cmd_func_t operation, char *summary, char *param)
     cmd->operation = operation;
     cmd->summary = summary;
     cmd->param = param;
+    cmd->calls = 0;
+    cmd->errors = 0;
+    cmd->time_total = 0;
+    cmd->time_max = 0;
     cmd->next = next_cmd;
     *last_loc = cmd;
+    name_insert(&cmd_table, name, cmd);
 }
 
 /* Add a new parameter */
@@ -114,51 +216,47 @@ void add_param(char *name, int *valp, char *summary, setter_func_t setter)
     param->setter = setter;
     param->next = next_param;
     *last_loc = param;
+    name_insert(&param_table, name, param);
 }
 
-/* Parse a string into a command line */
-static char **parse_args(char *line, int *argcp)
-{
-    /* Must first determine how many arguments there are.
-     * Replace all white space with null characters
-     */
-    size_t len = strlen(line);
-
-    /* First copy into buffer with each substring null-terminated */
-    char *buf = malloc_or_fail(len + 1, "parse_args");
-    buf[len] = '\0';
+/* Commands with more arguments than this need an allocated argv */
+#define MAXARGS 32
 
-    char *src = line;
-    char *dst = buf;
-    bool skipping = true;
-    int c;
+/* Split line into arguments in place, null-terminating each of them.
+ * argv must have room for MAXARGS pointers.  Return argv, or an array from
+ * calloc_or_fail when the line has more arguments.
+ */
+static char **parse_args(char *line, char **argv, int *argcp)
+{
+    char *p = line;
     int argc = 0;
-    while ((c = *src++) != '\0') {
-        if (isspace(c)) {
-            if (!skipping) {
-                /* Hit end of word */
-                *dst++ = '\0';
-                skipping = true;
-            }
-        } else {
-            if (skipping) {
-                /* Hit start of new word */
-                argc++;
-                skipping = false;
-            }
-            *dst++ = c;
-        }
+    while (true) {
+        while (isspace((unsigned char) *p))
+            p++;
+        if (*p == '\0')
+            break;
+        /* Hit start of new word */
+        if (argc < MAXARGS)
+            argv[argc] = p;
+        argc++;
+        while (*p && !isspace((unsigned char) *p))
+            p++;
+        /* Hit end of word */
+        if (*p)
+            *p++ = '\0';
     }
 
-    /* Now assemble into array of strings */
-    char **argv = calloc_or_fail(argc, sizeof(char *), "parse_args");
-    src = buf;
-    for (int i = 0; i < argc; i++) {
-        argv[i] = strsave_or_fail(src, "parse_args");
-        src += strlen(argv[i]) + 1;
+    if (argc > MAXARGS) {
+        argv = calloc_or_fail(argc, sizeof(char *), "parse_args");
+        p = line;
+        for (int i = 0; i < argc; i++) {
+            while (*p == '\0' || isspace((unsigned char) *p))
+                p++;
+            argv[i] = p;
+            p += strlen(p);
+        }
     }
 
-    free_block(buf, len + 1);
     *argcp = argc;
     return argv;
 }
@@ -172,18 +270,44 @@ static void record_error()
     }
 }
 
-/* Execute a command that has already been split into arguments */
-static bool interpret_cmda(int argc, char *argv[])
+/* Whether the commands made exactly the errors they were expected to */
+static bool errors_expected()
+{
+    return err_cnt == err_expected;
+}
+
+/* Report the time taken by a command that saw cnt elements */
+static void report_time(timing_t t, size_t cnt)
+{
+    delta_time(&last_time);
+    report_noreturn(1,
+                    "Delta time = %.3f (%" PRId64 " ns, %" PRId64 " cycles",
+                    t.ns * 1e-9, t.ns, t.cycles);
+    if (cnt)
+        report_noreturn(1, ", %.1f cycles/element", (double) t.cycles / cnt);
+    report(1, ")");
+}
+
+/* Execute a command that has already been looked up.
+ * cmd is NULL when no command is named argv[0].
+ */
+static bool exec_cmd(cmd_element_t *cmd, int argc, char *argv[])
 {
-    if (argc == 0)
-        return true;
-    /* Try to find matching command */
-    cmd_element_t *next_cmd = cmd_list;
     bool ok = true;
-    while (next_cmd && strcmp(argv[0], next_cmd->name) != 0)
-        next_cmd = next_cmd->next;
-    if (next_cmd) {
-        ok = next_cmd->operation(argc, argv);
+    if (cmd) {
+        double start_time;
+        reset_last_peak();
+        init_time(&start_time);
+        ok = cmd->operation(argc, argv);
+        double delta = delta_time(&start_time);
+        /* quit releases the command list */
+        if (!quit_flag) {
+            cmd->calls++;
+            cmd->errors += !ok;
+            cmd->time_total += delta;
+            if (delta > cmd->time_max)
+                cmd->time_max = delta;
+        }
         if (!ok)
             record_error();
     } else {
@@ -195,18 +319,237 @@ static bool interpret_cmda(int argc, char *argv[])
     return ok;
 }
 
+/* Execute a command that has already been split into arguments */
+static bool interpret_cmda(int argc, char *argv[])
+{
+    if (argc == 0)
+        return true;
+    /* Try to find matching command */
+    return exec_cmd(name_find(&cmd_table, argv[0]), argc, argv);
+}
+
+/* Loops.
+ *
+ * 'repeat N cmd ...' runs one command N times, and the lines between
+ * 'loop N' and the matching 'end' are run N times.  The lines of a loop body
+ * are split into arguments and looked up as they are read, then kept until
+ * the loop completes.  Loops may be nested.
+ */
+typedef struct {
+    cmd_element_t *cmd;
+    int argc;
+    char **argv;
+    /* Index of "loop" in argv when the line opens a nested loop, else -1 */
+    int loop_arg;
+} loop_cmd_t;
+
+static loop_cmd_t *loop_body = NULL;
+static size_t loop_cnt = 0;
+static size_t loop_size = 0;
+/* Iterations of the loop being read, or -1 outside of loops */
+static int loop_reps = -1;
+/* Report statistics about the iterations of the loop being read */
+static bool loop_timed = false;
+/* Nested loops opened within the body being read */
+static int loop_depth = 0;
+/* Set while the command of a web request runs.  Loops are read from files
+ * and the console only, so that a client cannot add commands to a loop that
+ * another source is in the middle of.
+ */
+static bool web_request = false;
+
+/* Loops being run.  Their commands cannot source files, which would only be
+ * read once the loops are over.
+ */
+static int loops_running = 0;
+
+/* Set by 'time' while it runs a command, which then times every iteration */
+static bool time_iterations = false;
+
+/* Parse the repetition count in argv[1] */
+static bool get_reps(int argc, char *argv[], int *reps)
+{
+    if (argc < 2) {
+        report(1, "%s needs a repetition count", argv[0]);
+        return false;
+    }
+    if (!get_int(argv[1], reps) || *reps < 0) {
+        report(1, "Invalid repetition count '%s'", argv[1]);
+        return false;
+    }
+    return true;
+}
+
+static int loop_opener(int argc, char *argv[])
+{
+    if (!strcmp(argv[0], "loop"))
+        return 0;
+    if (argc > 1 && !strcmp(argv[0], "time") && !strcmp(argv[1], "loop"))
+        return 1;
+    return -1;
+}
+
+static int cmp_int64(const void *a, const void *b)
+{
+    int64_t x = *(const int64_t *) a, y = *(const int64_t *) b;
+    return (x > y) - (x < y);
+}
+
+/* Report minimum, median and maximum of the times of cnt iterations */
+static void report_iterations(int64_t *ns, int cnt)
+{
+    if (!cnt)
+        return;
+    qsort(ns, cnt, sizeof(int64_t), cmp_int64);
+    report(1,
+           "%d iterations: min %" PRId64 " ns, median %" PRId64
+           " ns, max %" PRId64 " ns",
+           cnt, ns[0], ns[cnt / 2], ns[cnt - 1]);
+}
+
+static bool run_body(loop_cmd_t *body, size_t cnt);
+
+/* Run a body reps times, timing each iteration if asked to */
+static bool run_loop(loop_cmd_t *body, size_t cnt, int reps, bool timed)
+{
+    bool ok = true;
+    int64_t *ns = timed && reps
+                      ? malloc_or_fail(reps * sizeof(int64_t), "run_loop")
+                      : NULL;
+    int r;
+    loops_running++;
+    for (r = 0; r < reps && !quit_flag; r++) {
+        timing_t start = timing_now();
+        ok = run_body(body, cnt) && ok;
+        if (ns)
+            ns[r] = timing_since(start).ns;
+    }
+    loops_running--;
+    if (ns) {
+        report_iterations(ns, r);
+        free_block(ns, reps * sizeof(int64_t));
+    }
+    return ok;
+}
+
+static bool run_body(loop_cmd_t *body, size_t cnt)
+{
+    bool ok = true;
+    for (size_t i = 0; i < cnt && !quit_flag; i++) {
+        loop_cmd_t *c = &body[i];
+        if (c->loop_arg < 0) {
+            ok = exec_cmd(c->cmd, c->argc, c->argv) && ok;
+            continue;
+        }
+
+        /* Nested loop, up to the matching end */
+        size_t end = i + 1;
+        for (int depth = 0; depth || strcmp(body[end].argv[0], "end");
+             end++) {
+            if (body[end].loop_arg >= 0)
+                depth++;
+            else if (!strcmp(body[end].argv[0], "end"))
+                depth--;
+        }
+        int reps;
+        timing_t start = timing_now();
+        if (get_reps(c->argc - c->loop_arg, c->argv + c->loop_arg, &reps)) {
+            ok = run_loop(c + 1, end - i - 1, reps, c->loop_arg > 0) && ok;
+        } else {
+            record_error();
+            ok = false;
+        }
+        if (c->loop_arg > 0)
+            report_time(timing_since(start), 0);
+        i = end;
+    }
+    return ok;
+}
+
+static void free_body(loop_cmd_t *body, size_t cnt, size_t size)
+{
+    for (size_t i = 0; i < cnt; i++) {
+        for (int j = 0; j < body[i].argc; j++)
+            free_string(body[i].argv[j]);
+        free_array(body[i].argv, body[i].argc, sizeof(char *));
+    }
+    if (body)
+        free_array(body, size, sizeof(loop_cmd_t));
+}
+
+/* Add a line to the body of the loop being read.  Run the loop once its end
+ * has been read.
+ */
+static bool loop_add(cmd_element_t *cmd, int argc, char *argv[])
+{
+    int loop_arg = loop_opener(argc, argv);
+    if (!strcmp(argv[0], "end")) {
+        if (!loop_depth) {
+            loop_cmd_t *body = loop_body;
+            size_t cnt = loop_cnt, size = loop_size;
+            int reps = loop_reps;
+            bool timed = loop_timed;
+            loop_body = NULL;
+            loop_cnt = loop_size = 0;
+            loop_reps = -1;
+
+            timing_t start = timing_now();
+            bool ok = run_loop(body, cnt, reps, timed);
+            if (timed)
+                report_time(timing_since(start), 0);
+            free_body(body, cnt, size);
+            return ok;
+        }
+        loop_depth--;
+    } else if (loop_arg >= 0) {
+        loop_depth++;
+    }
+
+    if (loop_cnt == loop_size) {
+        size_t size = loop_size ? 2 * loop_size : 16;
+        loop_cmd_t *body = calloc_or_fail(size, sizeof(loop_cmd_t), "loop_add");
+        if (loop_cnt)
+            memcpy(body, loop_body, loop_cnt * sizeof(loop_cmd_t));
+        if (loop_body)
+            free_array(loop_body, loop_size, sizeof(loop_cmd_t));
+        loop_body = body;
+        loop_size = size;
+    }
+
+    loop_cmd_t *c = &loop_body[loop_cnt++];
+    c->cmd = cmd;
+    c->argc = argc;
+    c->argv = calloc_or_fail(argc, sizeof(char *), "loop_add");
+    for (int i = 0; i < argc; i++)
+        c->argv[i] = strsave_or_fail(argv[i], "loop_add");
+    c->loop_arg = loop_arg;
+    return true;
+}
+
+/* Execute a command from the input, or add it to the loop being read */
+static bool dispatch_cmd(cmd_element_t *cmd, int argc, char *argv[])
+{
+    if (argc == 0)
+        return true;
+    if (loop_reps >= 0 && !web_request)
+        return loop_add(cmd, argc, argv);
+    return exec_cmd(cmd, argc, argv);
+}
+
 /* Execute a command from a command line */
 static bool interpret_cmd(char *cmdline)
 {
     if (quit_flag)
         return false;
 
+    char *argv_buf[MAXARGS];
     int argc;
-    char **argv = parse_args(cmdline, &argc);
-    bool ok = interpret_cmda(argc, argv);
-    for (int i = 0; i < argc; i++)
-        free_string(argv[i]);
-    free_array(argv, argc, sizeof(char *));
+    char **argv = parse_args(cmdline, argv_buf, &argc);
+    bool ok =
+        dispatch_cmd(argc ? name_find(&cmd_table, argv[0]) : NULL, argc, argv);
+    if (argv != argv_buf)
+        free_array(argv, argc, sizeof(char *));
+    report_flush();
 
     return ok;
 }
@@ -220,12 +563,26 @@ void add_quit_helper(cmd_func_t qf)
         report_event(MSG_FATAL, "Exceeded limit on quit helpers");
 }
 
+/* Set function to be offered web requests before they run as commands */
+void add_web_route(web_route_t route)
+{
+    if (web_route_cnt < MAXROUTES)
+        web_routes[web_route_cnt++] = route;
+    else
+        report_event(MSG_FATAL, "Exceeded limit on web routes");
+}
+
 /* Turn echoing on/off */
 void set_echo(bool on)
 {
     echo = on ? 1 : 0;
 }
 
+void set_element_count(count_func_t count)
+{
+    element_count = count;
+}
+
 /* Built-in commands */
 static bool do_quit(int argc, char *argv[])
 {
@@ -236,6 +593,8 @@ static bool do_quit(int argc, char *argv[])
         c = c->next;
         free_block(ele, sizeof(cmd_element_t));
     }
+    cmd_list = NULL;
+    name_free(&cmd_table);
 
     param_element_t *p = param_list;
     while (p) {
@@ -243,14 +602,21 @@ static bool do_quit(int argc, char *argv[])
         p = p->next;
         free_block(ele, sizeof(param_element_t));
     }
+    param_list = NULL;
+    name_free(&param_table);
 
-    while (buf_stack)
-        pop_file();
-
+    /* Before the files go, as argv may point into their buffers */
     for (int i = 0; i < quit_helper_cnt; i++) {
         ok = ok && quit_helpers[i](argc, argv);
     }
 
+    while (buf_stack)
+        pop_file();
+
+    web_stop();
+    free_downloads();
+
+    report_barrier();
     quit_flag = true;
     return ok;
 }
@@ -316,7 +682,6 @@ static bool do_option(int argc, char *argv[])
     for (int i = 1; i < argc; i++) {
         char *name = argv[i];
         int value = 0;
-        bool found = false;
         /* Get value from next argument */
         if (i + 1 >= argc) {
             report(1, "No value given for parameter %s", name);
@@ -325,20 +690,19 @@ static bool do_option(int argc, char *argv[])
             report(1, "Cannot parse '%s' as integer", argv[i]);
             return false;
         }
-        /* Find parameter in list */
-        param_element_t *plist = param_list;
-        while (!found && plist) {
-            if (strcmp(plist->name, name) == 0) {
-                int oldval = *plist->valp;
-                *plist->valp = value;
-                if (plist->setter)
-                    plist->setter(oldval);
-                found = true;
-            } else
-                plist = plist->next;
-        }
-        /* Didn't find parameter */
-        if (!found) {
+        /* Find parameter */
+        param_element_t *param = name_find(&param_table, name);
+        if (param) {
+            int oldval = *param->valp;
+            *param->valp = value;
+            if (param->setter)
+                param->setter(oldval);
+            if (*param->valp != value) {
+                report(1, "Cannot set %s to %d", name, value);
+                return false;
+            }
+        } else {
+            /* Didn't find parameter */
             report(1, "Unknown parameter '%s'", name);
             return false;
         }
@@ -354,6 +718,14 @@ static bool do_source(int argc, char *argv[])
         return false;
     }
 
+    if (loops_running) {
+        report(1, "Cannot source a file within a loop");
+        return false;
+    }
+
+    if (is_compiled(argv[1]))
+        return run_compiled(argv[1]);
+
     if (!push_file(argv[1])) {
         report(1, "Could not open source file '%s'", argv[1]);
         return false;
@@ -370,7 +742,9 @@ static bool do_log(int argc, char *argv[])
     }
 
     bool result = set_logfile(argv[1]);
-    if (!result)
+    if (result)
+        add_download("log", argv[1]);
+    else
         report(1, "Couldn't open log file '%s'", argv[1]);
 
     return result;
@@ -384,20 +758,157 @@ static bool do_time(int argc, char *argv[])
         double elapsed = last_time - first_time;
         report(1, "Elapsed time = %.3f, Delta time = %.3f", elapsed, delta);
     } else {
+        size_t cnt = element_count ? element_count() : 0;
+        bool reading_loop = loop_reps >= 0;
+        time_iterations = true;
+        timing_t start = timing_now();
         ok = interpret_cmda(argc - 1, argv + 1);
+        timing_t t = timing_since(start);
+        time_iterations = false;
         if (block_flag) {
             block_timing = true;
+        } else if (!reading_loop && loop_reps >= 0) {
+            /* Timed by loop_add once the loop has run */
+            loop_timed = true;
         } else {
-            delta = delta_time(&last_time);
-            report(1, "Delta time = %.3f", delta);
+            /* Commands such as 'free' leave fewer elements than they saw */
+            if (element_count && element_count() > cnt)
+                cnt = element_count();
+            report_time(t, cnt);
         }
     }
 
     return ok;
 }
 
+static bool do_repeat(int argc, char *argv[])
+{
+    int reps;
+    if (!get_reps(argc, argv, &reps))
+        return false;
+    if (argc < 3) {
+        report(1, "%s needs a command to repeat", argv[0]);
+        return false;
+    }
+
+    /* Loops have to be written out with loop and end */
+    cmd_element_t *cmd = name_find(&cmd_table, argv[2]);
+    if (loop_opener(argc - 2, argv + 2) >= 0 || !strcmp(argv[2], "end")) {
+        report(1, "Cannot repeat '%s'", argv[2]);
+        return false;
+    }
+
+    bool timed = time_iterations;
+    time_iterations = false;
+    loop_cmd_t body = {cmd, argc - 2, argv + 2, -1};
+    return run_loop(&body, 1, reps, timed);
+}
+
+static bool do_loop(int argc, char *argv[])
+{
+    int reps;
+    if (!get_reps(argc, argv, &reps))
+        return false;
+    if (loop_reps >= 0 || web_request) {
+        report(1, "Cannot start a loop here");
+        return false;
+    }
+
+    /* Lines up to the matching end go to loop_add */
+    loop_reps = reps;
+    loop_timed = false;
+    loop_depth = 0;
+    return true;
+}
+
+static bool do_end(int argc, char *argv[])
+{
+    report(1, "%s without loop", argv[0]);
+    return false;
+}
+
+static bool do_heapprof(int argc, char *argv[])
+{
+    if (argc != 1) {
+        report(1, "%s takes no arguments", argv[0]);
+        return false;
+    }
+
+    heap_site_report(1);
+    return true;
+}
+
+/* Output of metrics_format(), grown to fit */
+static char *metrics_buf = NULL;
+static size_t metrics_size = 0;
+
+/* Format every metric into metrics_buf.
+ * Return false, with nothing formatted, when the buffer cannot grow enough.
+ */
+static bool format_metrics(metrics_format_t fmt, size_t *lenp)
+{
+    size_t len;
+    while ((len = metrics_format(metrics_buf, metrics_size, fmt)) >=
+           metrics_size) {
+        /* Leave room for metrics registered in the meantime */
+        size_t size = len * 2 + 1;
+        char *buf = realloc(metrics_buf, size);
+        if (!buf)
+            return false;
+        metrics_buf = buf;
+        metrics_size = size;
+    }
+    *lenp = len;
+    return true;
+}
+
+static bool do_stats(int argc, char *argv[])
+{
+    metrics_format_t fmt = METRICS_PROMETHEUS;
+    if (argc == 2 && !strcmp(argv[1], "json")) {
+        fmt = METRICS_JSON;
+    } else if (argc != 1) {
+        report(1, "%s takes an optional 'json' argument", argv[0]);
+        return false;
+    }
+
+    size_t len;
+    if (!format_metrics(fmt, &len)) {
+        report(1, "Not enough memory to format the metrics");
+        return false;
+    }
+    report_noreturn(1, "%s", metrics_buf);
+    return true;
+}
+
+/* Per-command metrics, one sample per command */
+#define CMD_COLLECTOR(field)                                \
+    static void collect_##field(metrics_out_t *out)         \
+    {                                                       \
+        for (cmd_element_t *c = cmd_list; c; c = c->next)   \
+            metrics_sample(out, c->name, (double) c->field); \
+    }
+
+CMD_COLLECTOR(calls)
+CMD_COLLECTOR(errors)
+CMD_COLLECTOR(time_total)
+CMD_COLLECTOR(time_max)
+
+static void add_cmd_metrics()
+{
+    metrics_add_family("qtest_command_calls_total", "Command invocations",
+                       METRIC_COUNTER, "command", collect_calls);
+    metrics_add_family("qtest_command_errors_total", "Failed invocations",
+                       METRIC_COUNTER, "command", collect_errors);
+    metrics_add_family("qtest_command_seconds_total",
+                       "Time spent executing the command", METRIC_COUNTER,
+                       "command", collect_time_total);
+    metrics_add_family("qtest_command_seconds_max",
+                       "Longest execution of the command", METRIC_GAUGE,
+                       "command", collect_time_max);
+}
+
 static bool use_linenoise = true;
-static int web_fd;
 
 static bool do_web(int argc, char *argv[])
 {
@@ -407,13 +918,14 @@ static bool do_web(int argc, char *argv[])
             port = atoi(argv[1]);
     }
 
-    web_fd = web_open(port);
-    if (web_fd > 0) {
-        printf("listen on port %d, fd is %d\n", port, web_fd);
+    if (web_start(port, cmd_loop, web_cmd)) {
+        /* Printed directly, so it must follow what is buffered */
+        report_flush();
+        printf("listen on port %d\n", port);
         use_linenoise = false;
     } else {
         perror("ERROR");
-        exit(web_fd);
+        exit(-1);
     }
     return true;
 }
@@ -496,6 +1008,8 @@ static int get_input(char player)
 static bool do_ttt(int argc, char *argv[])
 {
     // printf("in console game");
+    /* The game prints directly, after what is buffered */
+    report_flush();
     srand(time(NULL));
     char table[N_GRIDS];
     memset(table, ' ', N_GRIDS);
@@ -553,15 +1067,32 @@ void init_cmd()
     ADD_COMMAND(quit, "Exit program", "");
     ADD_COMMAND(source, "Read commands from source file", "");
     ADD_COMMAND(log, "Copy output to file", "file");
-    ADD_COMMAND(time, "Time command execution", "cmd arg ...");
+    ADD_COMMAND(time,
+                "Time command execution. Loops also report the time taken by "
+                "each iteration",
+                "cmd arg ...");
+    ADD_COMMAND(repeat, "Run command n times", "n cmd arg ...");
+    ADD_COMMAND(loop, "Run the following commands up to 'end' n times", "n");
+    ADD_COMMAND(end, "End the commands run by 'loop'", "");
     ADD_COMMAND(web, "Read commands from builtin web server", "[port]");
+    ADD_COMMAND(compile, "Translate trace into binary form for 'qtest -f'",
+                "infile outfile");
+    ADD_COMMAND(heapprof, "Show live heap usage by allocation site", "");
+    ADD_COMMAND(stats, "Show metrics in Prometheus text or JSON format",
+                "[json]");
     add_cmd("#", do_comment_cmd, "Display comment", "...");
     add_param("simulation", &simulation, "Start/Stop simulation mode", NULL);
     add_param("verbose", &verblevel, "Verbosity level", NULL);
     add_param("error", &err_limit, "Number of errors until exit", NULL);
+    add_param("expect_errors", &err_expected,
+              "Number of errors the commands are expected to make", NULL);
     add_param("echo", &echo, "Do/don't echo commands", NULL);
+    add_param("asynclog", &log_async,
+              "Write log file from a background thread", NULL);
     add_param("entropy", &show_entropy, "Show/Hide Shannon entropy", NULL);
     ADD_COMMAND(ttt, "Do tic-tac-toe game in console", "");
+    report_add_metrics();
+    add_cmd_metrics();
     init_in();
     init_time(&last_time);
     first_time = last_time;
@@ -588,6 +1119,11 @@ static bool push_file(char *fname)
     rnew->prev = buf_stack;
     buf_stack = rnew;
 
+    /* Only the file on top of the stack is read */
+    if (rnew->prev)
+        event_del(cmd_loop, rnew->prev->fd);
+    event_add(cmd_loop, fd, EVENT_READ, input_ready, NULL);
+
     return true;
 }
 
@@ -597,8 +1133,11 @@ static void pop_file()
     if (buf_stack) {
         rio_t *rsave = buf_stack;
         buf_stack = rsave->prev;
+        event_del(cmd_loop, rsave->fd);
         close(rsave->fd);
         free_block(rsave, sizeof(rio_t));
+        if (buf_stack)
+            event_add(cmd_loop, buf_stack->fd, EVENT_READ, input_ready, NULL);
     }
 }
 
@@ -606,20 +1145,29 @@ static void pop_file()
 static void init_in()
 {
     buf_stack = NULL;
+    if (!cmd_loop)
+        cmd_loop = event_loop_new();
+    if (!cmd_loop)
+        report_event(MSG_FATAL, "Cannot create event loop");
 }
 
 /* Read command from input file.
  * When hit EOF, close that file and return NULL
  */
+/* Return the next line of input, without its newline.
+ * Lines are handed out in place from the read buffer, and only copied to
+ * linebuf when they straddle the end of it.  The line stays valid until the
+ * next call.
+ */
 static char *readline()
 {
-    char c;
-    char *lptr = linebuf;
+    size_t len = 0; /* Bytes of the line gathered in linebuf */
+    char *line = linebuf;
 
     if (!buf_stack)
         return NULL;
 
-    for (int cnt = 0; cnt < RIO_BUFSIZE - 2; cnt++) {
+    while (true) {
         if (buf_stack->count <= 0) {
             /* Need to read from input file */
             buf_stack->count = read(buf_stack->fd, buf_stack->buf, RIO_BUFSIZE);
@@ -627,41 +1175,49 @@ static char *readline()
             if (buf_stack->count <= 0) {
                 /* Encountered EOF */
                 pop_file();
-                if (cnt > 0) {
-                    /* Last line of file did not terminate with newline. */
-                    /*  Terminate line & return it */
-                    *lptr++ = '\n';
-                    *lptr++ = '\0';
-                    if (echo) {
-                        report_noreturn(1, prompt);
-                        report_noreturn(1, linebuf);
-                    }
-                    return linebuf;
-                }
-                return NULL;
+                if (len == 0)
+                    return NULL;
+                /* Last line of file did not terminate with newline */
+                break;
             }
         }
 
         /* Have text in buffer */
-        c = *buf_stack->bufptr++;
-        *lptr++ = c;
-        buf_stack->count--;
-        if (c == '\n')
+        char *start = buf_stack->bufptr;
+        char *nl = memchr(start, '\n', buf_stack->count);
+        if (nl && len == 0) {
+            *nl = '\0';
+            line = start;
+            buf_stack->count -= nl + 1 - start;
+            buf_stack->bufptr = nl + 1;
             break;
-    }
+        }
 
-    if (c != '\n') {
-        /* Hit buffer limit.  Artificially terminate line */
-        *lptr++ = '\n';
+        size_t n = nl ? (size_t) (nl - start) : (size_t) buf_stack->count;
+        /* Artificially terminate lines that do not fit in linebuf */
+        if (n > RIO_BUFSIZE - 2 - len)
+            n = RIO_BUFSIZE - 2 - len;
+        memcpy(linebuf + len, start, n);
+        len += n;
+        buf_stack->bufptr += n;
+        buf_stack->count -= n;
+        if (nl && start + n == nl) {
+            buf_stack->bufptr++;
+            buf_stack->count--;
+            break;
+        }
+        if (len == RIO_BUFSIZE - 2)
+            break;
     }
-    *lptr++ = '\0';
 
+    if (line == linebuf)
+        linebuf[len] = '\0';
     if (echo) {
         report_noreturn(1, prompt);
-        report_noreturn(1, linebuf);
+        report(1, "%s", line);
     }
 
-    return linebuf;
+    return line;
 }
 
 static bool cmd_done()
@@ -669,96 +1225,191 @@ static bool cmd_done()
     return !buf_stack || quit_flag;
 }
 
-/* Handle command processing in program that uses select as main control
- * loop. Like select, but checks whether command input either present in
- * internal buffer or readable from command input.  If so, that command is
- * executed. Same return as select.  Command input file removed from readfds
- *
- * nfds should be set to the maximum file descriptor for network sockets.
- * If nfds == 0, this indicates that there is no pending network activity
+/* Serve GET /metrics (Prometheus) and GET /metrics/json.
+ * Return false when the request is for something else.
  */
-int web_connfd;
-static int cmd_select(int nfds,
-                      fd_set *readfds,
-                      fd_set *writefds,
-                      fd_set *exceptfds,
-                      struct timeval *timeout)
+static bool web_metrics(const char *path, web_response_t *resp)
 {
-    int infd;
-    fd_set local_readset;
+    /* Requests have '/' in the path turned into spaces */
+    metrics_format_t fmt;
+    if (!strcmp(path, "metrics")) {
+        fmt = METRICS_PROMETHEUS;
+        web_set_type(resp, "text/plain; version=0.0.4");
+    } else if (!strcmp(path, "metrics json")) {
+        fmt = METRICS_JSON;
+        web_set_type(resp, "application/json");
+    } else {
+        return false;
+    }
 
-    if (cmd_done())
-        return 0;
+    size_t len;
+    if (!format_metrics(fmt, &len)) {
+        /* Rather than a partial document */
+        web_set_status(resp, 500);
+        web_set_type(resp, "text/plain");
+        web_write(resp, "Out of memory\n", 14);
+        return true;
+    }
+    web_write(resp, metrics_buf, len);
+    return true;
+}
 
-    if (!block_flag) {
-        /* Process any commands in input buffer */
-        if (!readfds)
-            readfds = &local_readset;
+/* A line of the current input file is ready */
+static void input_ready(int fd, int events, void *arg)
+{
+    set_echo(0);
+    char *cmdline = readline();
+    if (cmdline)
+        interpret_cmd(cmdline);
+    prompt_flag = true;
+}
 
-        /* Add input fd to readset for select */
-        infd = buf_stack->fd;
-        FD_ZERO(readfds);
-        FD_SET(infd, readfds);
+/* Files that web clients may download */
+typedef struct __download {
+    char *name;
+    char *path;
+    struct __download *next;
+} download_t;
 
-        /* If web not ready listen */
-        if (web_fd != -1)
-            FD_SET(web_fd, readfds);
+static download_t *downloads = NULL;
 
-        if (infd == STDIN_FILENO && prompt_flag) {
-            printf("%s", prompt);
-            fflush(stdout);
-            prompt_flag = true;
+void add_download(const char *name, const char *path)
+{
+    download_t *d = downloads;
+    while (d && strcmp(d->name, name))
+        d = d->next;
+    /* Kept out of the heap accounting, which checks the queue for leaks */
+    if (!d) {
+        d = malloc(sizeof(download_t));
+        if (!d)
+            return;
+        d->name = strdup(name);
+        if (!d->name) {
+            free(d);
+            return;
         }
+        d->path = NULL;
+        d->next = downloads;
+        downloads = d;
+    }
+    free(d->path);
+    d->path = strdup(path);
+}
 
-        if (infd >= nfds)
-            nfds = infd + 1;
-        if (web_fd >= nfds)
-            nfds = web_fd + 1;
+static void free_downloads()
+{
+    while (downloads) {
+        download_t *d = downloads;
+        downloads = d->next;
+        free(d->name);
+        free(d->path);
+        free(d);
     }
-    if (nfds == 0)
-        return 0;
+}
 
-    int result = select(nfds, readfds, writefds, exceptfds, timeout);
-    if (result <= 0)
-        return result;
+/* Whether name is the one requested, in a path that has '/' turned into ' ' */
+static bool download_match(const char *name, const char *path)
+{
+    for (; *name && *path; name++, path++) {
+        if (*name != (*path == ' ' ? '/' : *path))
+            return false;
+    }
+    return *name == *path;
+}
 
-    infd = buf_stack->fd;
-    if (readfds && FD_ISSET(infd, readfds)) {
-        /* Commandline input available */
-        FD_CLR(infd, readfds);
-        result--;
+/* Serve GET /download/<name>, honoring byte ranges.
+ * Return false when the request is for something else.
+ */
+static bool web_download(const char *path, web_response_t *resp)
+{
+    if (strncmp(path, "download ", 9))
+        return false;
 
-        set_echo(0);
-        char *cmdline = readline();
-        if (cmdline)
-            interpret_cmd(cmdline);
-    } else if (readfds && FD_ISSET(web_fd, readfds)) {
-        FD_CLR(web_fd, readfds);
-        result--;
-        struct sockaddr_in clientaddr;
-        socklen_t clientlen = sizeof(clientaddr);
-        web_connfd =
-            accept(web_fd, (struct sockaddr *) &clientaddr, &clientlen);
-
-        char *p = web_recv(web_connfd, &clientaddr);
-        char *buffer = "HTTP/1.1 200 OK\r\nContent-Type: text/plain\r\n\r\n";
-        web_send(web_connfd, buffer);
-
-        if (p)
-            interpret_cmd(p);
-        free(p);
-        close(web_connfd);
+    download_t *d = downloads;
+    while (d && !download_match(d->name, path + 9))
+        d = d->next;
+    if (!d || !d->path || !web_send_file(resp, d->path)) {
+        web_set_status(resp, 404);
+        web_write(resp, "Not found\n", 10);
     }
-    return result;
+    return true;
+}
+
+/* Output reaches the client whenever the report buffer is flushed */
+static void web_capture(const char *buf, size_t len, void *arg)
+{
+    web_write(arg, buf, len);
+}
+
+/* Run the command of a web request, answering with its output */
+static void web_cmd(char *cmd, web_response_t *resp)
+{
+    if (web_metrics(cmd, resp) || web_download(cmd, resp))
+        return;
+    for (int i = 0; i < web_route_cnt; i++) {
+        if (web_routes[i](cmd, resp))
+            return;
+    }
+
+    report_set_sink(web_capture, resp);
+    web_request = true;
+    interpret_cmd(cmd);
+    web_request = false;
+    report_set_sink(NULL, NULL);
+    prompt_flag = true;
+}
+
+event_loop_t *cmd_event_loop()
+{
+    return cmd_loop;
+}
+
+/* Wait until a line of input, a web request or a timer is ready, and handle
+ * everything that is.  Return the number of events handled, or -1 on error.
+ */
+static int cmd_wait()
+{
+    if (cmd_done())
+        return 0;
+
+    /* Lines already buffered can be run without polling */
+    if (buf_stack->count > 0) {
+        input_ready(buf_stack->fd, EVENT_READ, NULL);
+        return 1;
+    }
+
+    if (buf_stack->fd == STDIN_FILENO && prompt_flag) {
+        printf("%s", prompt);
+        fflush(stdout);
+        prompt_flag = false;
+    }
+
+    return event_run_once(cmd_loop, -1);
+}
+
+/* Drop a loop still being read once the input has run out */
+static void close_loop()
+{
+    if (loop_reps < 0)
+        return;
+    report(1, "Missing 'end' of loop");
+    free_body(loop_body, loop_cnt, loop_size);
+    loop_body = NULL;
+    loop_cnt = loop_size = 0;
+    loop_reps = -1;
+    /* An error of the trace, but what is left to do must still be done */
+    err_cnt++;
 }
 
 bool finish_cmd()
 {
     bool ok = true;
+    close_loop();
     if (!quit_flag)
         ok = ok && do_quit(0, NULL);
     has_infile = false;
-    return ok && err_cnt == 0;
+    report_flush();
+    return ok && errors_expected();
 }
 
 static bool cmd_maybe(const char *target, const char *src)
@@ -802,8 +1453,248 @@ void completion(const char *buf, line_completions_t *lc)
     }
 }
 
+/* Compiled traces.
+ *
+ * 'compile' translates a text trace into a binary one, which 'qtest -f'
+ * replays without reading, splitting or looking up any command line.
+ * Layout, in native byte order:
+ *
+ *   char magic[8];         TRACE_MAGIC
+ *   uint32_t nstr;         Number of distinct words
+ *   uint32_t strbytes;     Size of the word table
+ *   uint32_t ncode;        Number of code words
+ *   char strs[strbytes];   Null-terminated words, each stored once
+ *   uint32_t code[ncode];  For each command, argc and the argc word indices
+ */
+#define TRACE_MAGIC "\0QTRACE1"
+#define TRACE_MAGIC_LEN 8
+
+typedef struct {
+    uint32_t nstr;
+    uint32_t strbytes;
+    uint32_t ncode;
+} trace_header_t;
+
+/* Growable byte buffer used while compiling */
+typedef struct {
+    char *data;
+    size_t len;
+    size_t size;
+} trace_buf_t;
+
+static void trace_put(trace_buf_t *b, const void *p, size_t len)
+{
+    if (b->len + len > b->size) {
+        size_t size = b->size ? b->size : 4096;
+        while (b->len + len > size)
+            size *= 2;
+        char *data = malloc_or_fail(size, "trace_put");
+        if (b->len)
+            memcpy(data, b->data, b->len);
+        if (b->data)
+            free_block(b->data, b->size);
+        b->data = data;
+        b->size = size;
+    }
+    memcpy(b->data + b->len, p, len);
+    b->len += len;
+}
+
+static void trace_put_word(trace_buf_t *b, uint32_t w)
+{
+    trace_put(b, &w, sizeof(w));
+}
+
+static bool do_compile(int argc, char *argv[])
+{
+    if (argc != 3) {
+        report(1, "%s needs 2 arguments", argv[0]);
+        return false;
+    }
+
+    FILE *in = fopen(argv[1], "r");
+    if (!in) {
+        report(1, "Couldn't open trace '%s'", argv[1]);
+        return false;
+    }
+
+    /* Words are interned: the table maps each to its index plus one */
+    name_table_t words = {NULL, 0, 0};
+    trace_buf_t strs = {NULL, 0, 0}, code = {NULL, 0, 0};
+    size_t ncmd = 0;
+    char *line = NULL;
+    size_t line_size = 0;
+    while (getline(&line, &line_size, in) != -1) {
+        char *argv_buf[MAXARGS];
+        int wc;
+        char **wv = parse_args(line, argv_buf, &wc);
+        if (wc > 0) {
+            ncmd++;
+            trace_put_word(&code, wc);
+        }
+        for (int i = 0; i < wc; i++) {
+            uintptr_t id = (uintptr_t) name_find(&words, wv[i]);
+            if (!id) {
+                char *w = strsave_or_fail(wv[i], "do_compile");
+                id = words.cnt + 1;
+                name_insert(&words, w, (void *) id);
+                trace_put(&strs, w, strlen(w) + 1);
+            }
+            trace_put_word(&code, id - 1);
+        }
+        if (wv != argv_buf)
+            free_array(wv, wc, sizeof(char *));
+    }
+    free(line);
+    fclose(in);
+
+    trace_header_t hdr = {words.cnt, strs.len, code.len / sizeof(uint32_t)};
+    FILE *out = fopen(argv[2], "wb");
+    bool ok = out && fwrite(TRACE_MAGIC, TRACE_MAGIC_LEN, 1, out) == 1 &&
+              fwrite(&hdr, sizeof(hdr), 1, out) == 1 &&
+              fwrite(strs.data, 1, strs.len, out) == strs.len &&
+              fwrite(code.data, 1, code.len, out) == code.len;
+    if (out && fclose(out) != 0)
+        ok = false;
+    if (ok)
+        report(1, "Compiled %lu commands, %u distinct words", ncmd, hdr.nstr);
+    else
+        report(1, "Couldn't write compiled trace '%s'", argv[2]);
+
+    for (size_t i = 0; i < words.size; i++) {
+        if (words.slots[i].name)
+            free_string((char *) words.slots[i].name);
+    }
+    name_free(&words);
+    if (strs.data)
+        free_block(strs.data, strs.size);
+    if (code.data)
+        free_block(code.data, code.size);
+    return ok;
+}
+
+/* Return whether fname starts like a compiled trace */
+static bool is_compiled(const char *fname)
+{
+    char magic[TRACE_MAGIC_LEN];
+    FILE *f = fopen(fname, "rb");
+    if (!f)
+        return false;
+    bool found = fread(magic, TRACE_MAGIC_LEN, 1, f) == 1 &&
+                 !memcmp(magic, TRACE_MAGIC, TRACE_MAGIC_LEN);
+    fclose(f);
+    return found;
+}
+
+/* Check the code of a compiled trace and find its largest argc */
+static bool check_code(const trace_header_t *hdr,
+                       const uint32_t *code,
+                       uint32_t *max_argc)
+{
+    *max_argc = 0;
+    for (uint32_t pc = 0; pc < hdr->ncode; pc += code[pc] + 1) {
+        uint32_t argc = code[pc];
+        if (argc == 0 || argc > hdr->ncode - pc - 1)
+            return false;
+        for (uint32_t i = 1; i <= argc; i++) {
+            if (code[pc + i] >= hdr->nstr)
+                return false;
+        }
+        if (argc > *max_argc)
+            *max_argc = argc;
+    }
+    return true;
+}
+
+/* Replay a compiled trace.  Commands are resolved once per distinct word
+ * and executed with argv pointing into the word table.  Return false if the
+ * trace cannot be read.
+ */
+static bool run_compiled(const char *fname)
+{
+    trace_header_t hdr;
+    char magic[TRACE_MAGIC_LEN];
+    FILE *f = fopen(fname, "rb");
+    if (!f || fread(magic, TRACE_MAGIC_LEN, 1, f) != 1 ||
+        fread(&hdr, sizeof(hdr), 1, f) != 1) {
+        report(1, "ERROR: Could not read compiled trace '%s'", fname);
+        if (f)
+            fclose(f);
+        return false;
+    }
+
+    struct stat st;
+    uint64_t size = TRACE_MAGIC_LEN + sizeof(hdr) + (uint64_t) hdr.strbytes +
+                    (uint64_t) hdr.ncode * sizeof(uint32_t);
+    if (fstat(fileno(f), &st) != 0 || (uint64_t) st.st_size != size) {
+        report(1, "ERROR: Corrupted compiled trace '%s'", fname);
+        fclose(f);
+        return false;
+    }
+
+    char *strs = malloc_or_fail(hdr.strbytes + 1, "run_compiled");
+    uint32_t *code = calloc_or_fail(hdr.ncode + 1, sizeof(uint32_t),
+                                    "run_compiled");
+    bool ok = fread(strs, 1, hdr.strbytes, f) == hdr.strbytes &&
+              fread(code, sizeof(uint32_t), hdr.ncode, f) == hdr.ncode;
+    fclose(f);
+
+    /* Index the word table */
+    char **words = calloc_or_fail(hdr.nstr + 1, sizeof(char *), "run_compiled");
+    strs[hdr.strbytes] = '\0';
+    char *w = strs;
+    uint32_t nstr = 0;
+    while (ok && w < strs + hdr.strbytes && nstr < hdr.nstr) {
+        words[nstr++] = w;
+        w += strlen(w) + 1;
+    }
+    ok = ok && nstr == hdr.nstr && w == strs + hdr.strbytes;
+
+    uint32_t max_argc;
+    ok = ok && check_code(&hdr, code, &max_argc);
+    if (!ok) {
+        report(1, "ERROR: Corrupted compiled trace '%s'", fname);
+    } else {
+        cmd_element_t **cmds =
+            calloc_or_fail(hdr.nstr + 1, sizeof(cmd_element_t *),
+                           "run_compiled");
+        for (uint32_t i = 0; i < hdr.nstr; i++)
+            cmds[i] = name_find(&cmd_table, words[i]);
+        char **argv =
+            calloc_or_fail(max_argc + 1, sizeof(char *), "run_compiled");
+
+        /* Files the trace sources are read up to the one it came from */
+        rio_t *top = buf_stack;
+        has_infile = true;
+        for (uint32_t pc = 0; pc < hdr.ncode && !quit_flag;
+             pc += code[pc] + 1) {
+            int argc = code[pc];
+            for (int i = 0; i < argc; i++)
+                argv[i] = words[code[pc + 1 + i]];
+            /* As input_ready does for every line read */
+            set_echo(0);
+            dispatch_cmd(cmds[code[pc + 1]], argc, argv);
+            report_flush();
+            /* Files opened by 'source' */
+            while (buf_stack != top && !quit_flag)
+                cmd_wait();
+        }
+
+        free_array(argv, max_argc + 1, sizeof(char *));
+        free_array(cmds, hdr.nstr + 1, sizeof(cmd_element_t *));
+    }
+
+    free_array(words, hdr.nstr + 1, sizeof(char *));
+    free_array(code, hdr.ncode + 1, sizeof(uint32_t));
+    free_block(strs, hdr.strbytes + 1);
+    return ok;
+}
+
 bool run_console(char *infile_name)
 {
+    if (infile_name && is_compiled(infile_name))
+        return run_compiled(infile_name) && errors_expected();
+
     if (!push_file(infile_name)) {
         report(1, "ERROR: Could not open source file '%s'", infile_name);
         return false;
@@ -812,22 +1703,24 @@ bool run_console(char *infile_name)
     if (!has_infile) {
         char *cmdline;
         while (use_linenoise && (cmdline = linenoise(prompt))) {
-            interpret_cmd(cmdline);
+            /* Before the command line is split up by interpret_cmd */
             line_history_add(cmdline);       /* Add to the history. */
             line_history_save(HISTORY_FILE); /* Save the history on disk. */
+            interpret_cmd(cmdline);
             line_free(cmdline);
             while (buf_stack && buf_stack->fd != STDIN_FILENO)
-                cmd_select(0, NULL, NULL, NULL, NULL);
+                cmd_wait();
             has_infile = false;
         }
         if (!use_linenoise) {
             while (!cmd_done())
-                cmd_select(0, NULL, NULL, NULL, NULL);
+                cmd_wait();
         }
     } else {
         while (!cmd_done())
-            cmd_select(0, NULL, NULL, NULL, NULL);
+            cmd_wait();
     }
 
-    return err_cnt == 0;
+    close_loop();
+    return errors_expected();
 }
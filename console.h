@@ -2,9 +2,10 @@
 #define LAB0_CONSOLE_H
 
 #include <stdbool.h>
-#include <sys/select.h>
-
+#include <stddef.h>
+#include "event.h"
 #include "linenoise.h"
+#include "web.h"
 
 #define HISTORY_FILE ".cmd_history"
 
@@ -24,10 +25,17 @@ typedef struct __cmd_element {
     cmd_func_t operation;
     char *summary;
     char *param;
+    /* Usage statistics, exported as metrics */
+    size_t calls;
+    size_t errors;
+    double time_total; /* Seconds */
+    double time_max;   /* Seconds */
     struct __cmd_element *next;
 } cmd_element_t;
 
-/* Optionally supply function that gets invoked when parameter changes */
+/* Optionally supply function that gets invoked when parameter changes.
+ * It refuses the new value by restoring oldval.
+ */
 typedef void (*setter_func_t)(int oldval);
 
 /* Integer-valued parameters */
@@ -59,6 +67,23 @@ void add_quit_helper(cmd_func_t qf);
 /* Turn echoing on/off */
 void set_echo(bool on);
 
+/* Number of elements the commands operate on, used by 'time' to report the
+ * cost per element
+ */
+typedef size_t (*count_func_t)(void);
+void set_element_count(count_func_t count);
+
+/* Answer a web request without running a command.  path has '/' turned
+ * into spaces.  Return false to leave the request to the interpreter.
+ */
+typedef bool (*web_route_t)(char *path, web_response_t *resp);
+void add_web_route(web_route_t route);
+
+/* Let web clients download the file at path as /download/<name>.  name may
+ * contain '/', which keeps files of different kinds apart.
+ */
+void add_download(const char *name, const char *path);
+
 /* Complete command interpretation */
 
 /* Return true if no errors occurred */
@@ -68,6 +93,11 @@ bool finish_cmd();
  */
 bool run_console(char *infile_name);
 
+/* Event loop run by the console while it waits for input.
+ * Descriptors and timers may be added to it, such as for periodic reports.
+ */
+event_loop_t *cmd_event_loop();
+
 /* Callback function to complete command by linenoise */
 void completion(const char *buf, line_completions_t *lc);
 
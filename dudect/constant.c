@@ -3,14 +3,15 @@
 #include <string.h>
 
 #include "constant.h"
-#include "cpucycles.h"
 #include "queue.h"
 #include "random.h"
+#include "timing.h"
 
 /* Maintain a queue independent from the qtest since
- * we do not want the test to affect the original functionality
+ * we do not want the test to affect the original functionality.
+ * Threads measuring in parallel each have their own.
  */
-static struct list_head *l = NULL;
+static __thread struct list_head *l = NULL;
 
 #define dut_new() ((void) (l = q_new()))
 
@@ -36,8 +37,8 @@ static struct list_head *l = NULL;
 
 #define dut_free() ((void) (q_free(l)))
 
-static char random_string[N_MEASURES][8];
-static int random_string_iter = 0;
+static __thread char random_string[N_MEASURES][8];
+static __thread int random_string_iter = 0;
 
 /* Implement the necessary queue interface to simulation */
 void init_dut(void)
@@ -84,9 +85,9 @@ bool measure(int64_t *before_ticks,
                 get_random_string(),
                 *(uint16_t *) (input_data + i * CHUNK_SIZE) % 10000);
             int before_size = q_size(l);
-            before_ticks[i] = cpucycles();
+            before_ticks[i] = timing_cycles();
             dut_insert_head(s, 1);
-            after_ticks[i] = cpucycles();
+            after_ticks[i] = timing_cycles();
             int after_size = q_size(l);
             dut_free();
             if (before_size != after_size - 1)
@@ -101,9 +102,9 @@ bool measure(int64_t *before_ticks,
                 get_random_string(),
                 *(uint16_t *) (input_data + i * CHUNK_SIZE) % 10000);
             int before_size = q_size(l);
-            before_ticks[i] = cpucycles();
+            before_ticks[i] = timing_cycles();
             dut_insert_tail(s, 1);
-            after_ticks[i] = cpucycles();
+            after_ticks[i] = timing_cycles();
             int after_size = q_size(l);
             dut_free();
             if (before_size != after_size - 1)
@@ -117,9 +118,9 @@ bool measure(int64_t *before_ticks,
                 get_random_string(),
                 *(uint16_t *) (input_data + i * CHUNK_SIZE) % 10000 + 1);
             int before_size = q_size(l);
-            before_ticks[i] = cpucycles();
+            before_ticks[i] = timing_cycles();
             element_t *e = q_remove_head(l, NULL, 0);
-            after_ticks[i] = cpucycles();
+            after_ticks[i] = timing_cycles();
             int after_size = q_size(l);
             if (e)
                 q_release_element(e);
@@ -135,9 +136,9 @@ bool measure(int64_t *before_ticks,
                 get_random_string(),
                 *(uint16_t *) (input_data + i * CHUNK_SIZE) % 10000 + 1);
             int before_size = q_size(l);
-            before_ticks[i] = cpucycles();
+            before_ticks[i] = timing_cycles();
             element_t *e = q_remove_tail(l, NULL, 0);
-            after_ticks[i] = cpucycles();
+            after_ticks[i] = timing_cycles();
             int after_size = q_size(l);
             if (e)
                 q_release_element(e);
@@ -152,9 +153,9 @@ bool measure(int64_t *before_ticks,
             dut_insert_head(
                 get_random_string(),
                 *(uint16_t *) (input_data + i * CHUNK_SIZE) % 10000);
-            before_ticks[i] = cpucycles();
+            before_ticks[i] = timing_cycles();
             dut_size(1);
-            after_ticks[i] = cpucycles();
+            after_ticks[i] = timing_cycles();
             dut_free();
         }
     }
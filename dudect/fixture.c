@@ -26,16 +26,29 @@
  *    variable time.
  */
 
+/* Needed by pthread_setaffinity_np() */
+#if defined(__linux__)
+#define _GNU_SOURCE
+#endif
+
 #include <assert.h>
 #include <math.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
 #include "../console.h"
 #include "../random.h"
 
+/* Workers need the allocation modes of the harness */
+#define INTERNAL 1
+#include "../harness.h"
+
 #include "constant.h"
 #include "fixture.h"
 #include "ttest.h"
@@ -43,7 +56,34 @@
 #define ENOUGH_MEASURE 10000
 #define TEST_TRIES 10
 #define DUDECT_NUMBER_PERCENTILES (100)
-static t_context_t *t;
+#define MAX_THREADS 64
+
+/* Batches of measurements, after the warm-up one, to reach ENOUGH_MEASURE */
+#define ENOUGH_BATCHES                                  \
+    ((ENOUGH_MEASURE + N_MEASURES - DROP_SIZE * 2 - 1) / \
+     (N_MEASURES - DROP_SIZE * 2))
+
+/* The first test is on the raw execution times, each other one on the
+ * execution times below a percentile.
+ */
+#define DUDECT_TESTS (1 + DUDECT_NUMBER_PERCENTILES)
+
+/* A cropped test only holds part of the measurements.  It takes part in the
+ * verdict once it has this many.
+ */
+#define ENOUGH_CROPPED (ENOUGH_MEASURE / 10)
+
+/* Measurements before the sequential mode may decide early */
+#define ENOUGH_SEQUENTIAL (ENOUGH_MEASURE / 4)
+
+/* Statistics of a constant-time test */
+typedef struct {
+    int64_t *percentiles;
+    t_context_t tests[DUDECT_TESTS];
+} stats_t;
+
+int dudect_threads = 1;
+int dudect_sequential = 0;
 
 /* threshold values for Welch's t-test */
 enum {
@@ -51,29 +91,68 @@ enum {
     t_threshold_moderate = 10, /* Test failed */
 };
 
-static int cmp(const int64_t *a, const int64_t *b)
+/* Move the elements of the nranks increasing ranks among a[lo..hi] to where
+ * they would be if a was sorted, without sorting the rest.  Each partition,
+ * as in Hoare's quickselect, is only pursued on the sides holding ranks.
+ */
+static void select_ranks(int64_t *a,
+                         long lo,
+                         long hi,
+                         const long *ranks,
+                         size_t nranks)
 {
-    return (int) (*a - *b);
+    while (nranks && lo < hi) {
+        int64_t pivot = a[lo + (hi - lo) / 2];
+        long i = lo, j = hi;
+        while (i <= j) {
+            while (a[i] < pivot)
+                i++;
+            while (a[j] > pivot)
+                j--;
+            if (i <= j) {
+                int64_t tmp = a[i];
+                a[i++] = a[j];
+                a[j--] = tmp;
+            }
+        }
+
+        /* a[lo..j] <= pivot <= a[i..hi], and a[j+1..i-1] == pivot */
+        size_t left = 0, right = nranks;
+        while (left < nranks && ranks[left] <= j)
+            left++;
+        while (right > left && ranks[right - 1] >= i)
+            right--;
+        select_ranks(a, lo, j, ranks, left);
+        ranks += right;
+        nranks -= right;
+        lo = i;
+    }
 }
 
-static int64_t percentile(int64_t *a_sorted, double which, size_t size)
+static long percentile_rank(double which, size_t size)
 {
     size_t array_position = (size_t) ((double) size * (double) which);
     assert(array_position < size);
-    return a_sorted[array_position];
+    return (long) array_position;
 }
 
-static void prepare_percentiles(t_context_t *t, int64_t *exec_times)
+/* The percentiles are taken among the measured inputs only, as the execution
+ * times of the dropped ones stay at zero.
+ */
+static void prepare_percentiles(int64_t *percentiles, int64_t *exec_times)
 {
-    qsort(exec_times, N_MEASURES, sizeof(int64_t),
-          (int (*)(const void *, const void *)) cmp);
-
+    int64_t *measured = exec_times + DROP_SIZE;
+    size_t size = N_MEASURES - DROP_SIZE * 2;
+    long ranks[DUDECT_NUMBER_PERCENTILES];
     for (size_t i = 0; i < DUDECT_NUMBER_PERCENTILES; i++) {
-        t->percentiles[i] = percentile(
-            exec_times,
+        ranks[i] = percentile_rank(
             1 - (pow(0.5, 10 * (double) (i + 1) / DUDECT_NUMBER_PERCENTILES)),
-            N_MEASURES);
+            size);
     }
+    select_ranks(measured, 0, size - 1, ranks, DUDECT_NUMBER_PERCENTILES);
+
+    for (size_t i = 0; i < DUDECT_NUMBER_PERCENTILES; i++)
+        percentiles[i] = measured[ranks[i]];
 }
 
 static void __attribute__((noreturn)) die(void)
@@ -89,35 +168,141 @@ static void differentiate(int64_t *exec_times,
         exec_times[i] = after_ticks[i] - before_ticks[i];
 }
 
-static void update_statistics(const int64_t *exec_times, uint8_t *classes)
+static void stats_init(stats_t *s)
+{
+    for (size_t i = 0; i < DUDECT_TESTS; i++)
+        t_init(&s->tests[i]);
+}
+
+/* Add the statistics of src to dst, which share their percentiles */
+static void stats_merge(stats_t *dst, const stats_t *src)
+{
+    for (size_t i = 0; i < DUDECT_TESTS; i++)
+        t_merge(&dst->tests[i], &src->tests[i]);
+}
+
+/* Number of measurements taken into the statistics */
+static double stats_count(const stats_t *s)
+{
+    return s->tests[0].n[0] + s->tests[0].n[1];
+}
+
+/* Index of the first percentile above x, as the percentiles never decrease,
+ * or DUDECT_NUMBER_PERCENTILES if there is none.
+ */
+static size_t first_above(const int64_t *percentiles, int64_t x)
+{
+    size_t lo = 0, hi = DUDECT_NUMBER_PERCENTILES;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (percentiles[mid] > x)
+            hi = mid;
+        else
+            lo = mid + 1;
+    }
+    return lo;
+}
+
+/* Samples of a class between two consecutive percentiles.  The sums are
+ * exact, so that they add up without rounding.
+ */
+typedef struct {
+    int64_t n;
+    int64_t sum;
+    __int128 sum_sq;
+} bucket_t;
+
+static void bucket_add(bucket_t *dst, const bucket_t *src)
+{
+    dst->n += src->n;
+    dst->sum += src->sum;
+    dst->sum_sq += src->sum_sq;
+}
+
+/* Add the samples of a class in b to the test t */
+static void bucket_merge(t_context_t *t, int class, const bucket_t *b)
 {
+    if (!b->n)
+        return;
+
+    /* n * m2 = n * sum(x^2) - sum(x)^2, exactly */
+    t_context_t batch = {{0}};
+    batch.n[class] = b->n;
+    batch.mean[class] = (double) b->sum / b->n;
+    batch.m2[class] =
+        (double) (b->n * b->sum_sq - (__int128) b->sum * b->sum) / b->n;
+    t_merge(t, &batch);
+}
+
+/* Every sample is part of the raw test, and of the cropped test of each
+ * percentile above it.  Rather than pushing it into up to DUDECT_TESTS
+ * contexts, it is counted in the bucket of the first percentile above it.
+ * Prefix sums of the buckets then give the samples of each test.
+ */
+static void update_statistics(stats_t *s,
+                              const int64_t *exec_times,
+                              uint8_t *classes)
+{
+    /* The last bucket holds the samples above every percentile */
+    bucket_t buckets[2][DUDECT_NUMBER_PERCENTILES + 1];
+    memset(buckets, 0, sizeof(buckets));
+
     for (size_t i = 10; /* discard the first few measurements */ i < N_MEASURES;
          i++) {
         int64_t difference = exec_times[i];
         /* CPU cycle counter overflowed or dropped measurement */
         if (difference <= 0)
             continue;
+        size_t crop_index = first_above(s->percentiles, difference);
+        bucket_t *b = &buckets[classes[i]][crop_index];
+        b->n++;
+        b->sum += difference;
+        b->sum_sq += (__int128) difference * difference;
+    }
+
+    for (int class = 0; class < 2; class ++) {
+        bucket_t below = {0};
         for (size_t crop_index = 0; crop_index < DUDECT_NUMBER_PERCENTILES;
              crop_index++) {
-            if (difference < t->percentiles[crop_index]) {
-                t_push(t, difference, classes[i]);
-            }
+            bucket_add(&below, &buckets[class][crop_index]);
+            bucket_merge(&s->tests[crop_index + 1], class, &below);
         }
-        /* do a t-test on the execution time */
+        bucket_add(&below, &buckets[class][DUDECT_NUMBER_PERCENTILES]);
+        bucket_merge(&s->tests[0], class, &below);
     }
 }
 
-static bool report(void)
+/* The test of the largest t among those with enough measurements */
+static t_context_t *max_test(stats_t *s)
 {
+    size_t ret = 0;
+    double max = 0;
+    for (size_t i = 0; i < DUDECT_TESTS; i++) {
+        t_context_t *test = &s->tests[i];
+        if (test->n[0] + test->n[1] < ENOUGH_CROPPED)
+            continue;
+        double x = fabs(t_compute(test));
+        if (max < x) {
+            max = x;
+            ret = i;
+        }
+    }
+    return &s->tests[ret];
+}
+
+static bool report(stats_t *s)
+{
+    double number_traces = stats_count(s);
+    t_context_t *t = max_test(s);
     double max_t = fabs(t_compute(t));
     double number_traces_max_t = t->n[0] + t->n[1];
     double max_tau = max_t / sqrt(number_traces_max_t);
 
     printf("\033[A\033[2K");
-    printf("meas: %7.2lf M, ", (number_traces_max_t / 1e6));
-    if (number_traces_max_t < ENOUGH_MEASURE) {
+    printf("meas: %7.2lf M, ", (number_traces / 1e6));
+    if (number_traces < ENOUGH_MEASURE) {
         printf("not enough measurements (%.0f still to go).\n",
-               ENOUGH_MEASURE - number_traces_max_t);
+               ENOUGH_MEASURE - number_traces);
         return false;
     }
 
@@ -146,7 +331,11 @@ static bool report(void)
     return true;
 }
 
-static bool doit(int mode)
+/* Measure a batch of inputs.  The first batch of a test only sets the
+ * percentiles of s, later ones add to its statistics, if s is not NULL.
+ * Return false if the operation misbehaved.
+ */
+static bool measure_batch(stats_t *s, int mode, bool first_time)
 {
     int64_t *before_ticks = calloc(N_MEASURES + 1, sizeof(int64_t));
     int64_t *after_ticks = calloc(N_MEASURES + 1, sizeof(int64_t));
@@ -154,8 +343,6 @@ static bool doit(int mode)
     uint8_t *classes = calloc(N_MEASURES, sizeof(uint8_t));
     uint8_t *input_data = calloc(N_MEASURES * CHUNK_SIZE, sizeof(uint8_t));
 
-    t->percentiles =
-        (int64_t *) calloc(DUDECT_NUMBER_PERCENTILES, sizeof(int64_t));
     if (!before_ticks || !after_ticks || !exec_times || !classes ||
         !input_data) {
         die();
@@ -164,18 +351,16 @@ static bool doit(int mode)
     prepare_inputs(input_data, classes);
     bool ret = measure(before_ticks, after_ticks, input_data, mode);
     differentiate(exec_times, before_ticks, after_ticks);
-    bool first_time = t->percentiles[DUDECT_NUMBER_PERCENTILES - 1] == 0;
-    if (first_time) {
+    if (!s) {
+        /* Only the behavior of the operation is checked */
+    } else if (first_time) {
         // throw away the first batch of measurements.
         // this helps warming things up.
-        prepare_percentiles(t, exec_times);
+        prepare_percentiles(s->percentiles, exec_times);
     } else {
-        update_statistics(exec_times, classes);
-        ret &= report();
+        update_statistics(s, exec_times, classes);
     }
 
-
-
     free(before_ticks);
     free(after_ticks);
     free(exec_times);
@@ -185,31 +370,364 @@ static bool doit(int mode)
     return ret;
 }
 
-static void init_once(void)
+/* Shared by the threads measuring a test in parallel */
+static struct {
+    pthread_mutex_t lock;
+    int mode;
+    int64_t percentiles[DUDECT_NUMBER_PERCENTILES];
+    int batches;      /* Batches of a whole test */
+    int batches_left; /* Batches not yet taken by a worker */
+    bool stop;        /* No more batches are needed */
+    int verdict;      /* Sequential mode: 1 for a leak, -1 for none */
+    bool ok;          /* The operation behaved correctly */
+    stats_t total;
+} shared = {.lock = PTHREAD_MUTEX_INITIALIZER};
+
+typedef struct {
+    pthread_t thread;
+    int cpu;
+    stats_t s;       /* Statistics of the batch being measured */
+    char error[256]; /* First error of the harness met, if any */
+} worker_t;
+
+/* Verdict on the statistics merged so far, of n measurements and largest t
+ * t_value: 1 for a leak, -1 for none, 0 if they are not conclusive yet.
+ *
+ * f is the fraction of the measurements of the whole test taken.  A leak is
+ * reported once t_value passes c / sqrt(f): the bound of O'Brien and
+ * Fleming, strict on the first batches, where a few outliers weigh most,
+ * and down to c at the end.  As t is looked at after every batch, c is
+ * raised so that a constant-time operation is as likely to ever cross the
+ * bound as to end above t_threshold_moderate in the full test: for a
+ * Brownian motion, 2 P(Z > c) = P(Z > t_threshold_moderate).
+ *
+ * No leak is reported once half of the test is measured, if t_value is
+ * below T sqrt(f) / 2, where T is t_threshold_moderate.  With a leak just
+ * large enough to end at T, t_value after a fraction f is about
+ * N(T sqrt(f), 1), so it stops there with probability P(Z > T sqrt(f) / 2),
+ * at most P(Z > 3.5) = 2e-4 per batch from f = 0.5 on, or below 1% over
+ * the test.  Larger leaks are even less likely to stop.  Without a leak,
+ * t_value is about |N(0, 1)|, so the test mostly stops at f = 0.5.
+ * dudect_check_sequential() checks both cases.
+ */
+static int sequential_verdict(double n, double t_value)
+{
+    double c = t_threshold_moderate + log(2) / t_threshold_moderate;
+    double f = n / (ENOUGH_BATCHES * (N_MEASURES - DROP_SIZE * 2));
+    if (f > 1)
+        f = 1;
+    if (t_value > c / sqrt(f))
+        return 1;
+    if (f >= 0.5 && t_value / sqrt(f) < t_threshold_moderate / 2)
+        return -1;
+    return 0;
+}
+
+/* Take batches, adding their statistics to the total, until none is left
+ * or a verdict is reached.  w->s holds the statistics of a single batch.
+ * An error of the harness fails the test, and is kept in w->error.
+ */
+static void measure_batches(worker_t *w)
+{
+    stats_t *s = &w->s;
+    s->percentiles = shared.percentiles;
+    pthread_mutex_lock(&shared.lock);
+    while (!shared.stop && shared.batches_left > 0) {
+        shared.batches_left--;
+        pthread_mutex_unlock(&shared.lock);
+
+        stats_init(s);
+        bool ok = measure_batch(s, shared.mode, false);
+        if (worker_error(w->error, sizeof(w->error)))
+            ok = false;
+
+        pthread_mutex_lock(&shared.lock);
+        stats_merge(&shared.total, s);
+        double n = stats_count(&shared.total);
+        if (!ok) {
+            shared.ok = false;
+            shared.stop = true;
+        } else if (dudect_sequential && n >= ENOUGH_SEQUENTIAL) {
+            double t_value = fabs(t_compute(max_test(&shared.total)));
+            shared.verdict = sequential_verdict(n, t_value);
+            shared.stop = shared.verdict != 0;
+        } else if (n >= ENOUGH_MEASURE) {
+            double t_value = fabs(t_compute(max_test(&shared.total)));
+            /* Definitely not constant time: more batches cannot help */
+            if (t_value > t_threshold_bananas)
+                shared.stop = true;
+        }
+    }
+    pthread_mutex_unlock(&shared.lock);
+}
+
+static void *measure_worker(void *arg)
 {
+    worker_t *w = arg;
+
+#if defined(__linux__)
+    /* Stay on one core, where the cycle counter is consistent */
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    CPU_SET(w->cpu, &cpus);
+    pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+#endif
+    set_worker_mode(true);
     init_dut();
-    t_init(t);
+    measure_batches(w);
+    return NULL;
 }
 
-static bool test_const(char *text, int mode)
+/* Spread the batches of one attempt of a test over threads, each on a core
+ * of its own, with a queue of its own, or measure them here if there is a
+ * single thread.  The percentiles are set by a first batch, measured before
+ * the workers start, and the statistics of the workers are merged as they
+ * come.
+ */
+static bool doit_parallel(int mode, int threads)
+{
+    static worker_t workers[MAX_THREADS];
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+    shared.mode = mode;
+    shared.batches = ENOUGH_BATCHES;
+    shared.batches_left = shared.batches;
+    shared.stop = false;
+    shared.verdict = 0;
+    shared.ok = true;
+    shared.total.percentiles = shared.percentiles;
+    stats_init(&shared.total);
+
+    stats_t *first = &workers[0].s;
+    first->percentiles = shared.percentiles;
+    init_dut();
+    if (!measure_batch(first, mode, true))
+        return false;
+
+    /* The harness interrupts the main thread only */
+    sigset_t all, old;
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    int started = 0;
+    for (; threads > 1 && started < threads; started++) {
+        worker_t *w = &workers[started];
+        w->cpu = cpus > 0 ? started % cpus : 0;
+        w->error[0] = '\0';
+        if (pthread_create(&w->thread, NULL, measure_worker, w))
+            break;
+    }
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+    /* With a single thread, or none started, batches are measured here */
+    if (!started)
+        measure_batches(&workers[0]);
+    for (int i = 0; i < started; i++)
+        pthread_join(workers[i].thread, NULL);
+
+    /* Workers leave their errors to be reported here */
+    for (int i = 0; i < started; i++) {
+        if (workers[i].error[0])
+            report_worker_error(workers[i].error);
+    }
+
+    if (shared.verdict)
+        return shared.verdict < 0 && shared.ok;
+    return report(&shared.total) && shared.ok;
+}
+
+static bool test_const_parallel(char *text, int mode, int threads)
 {
     bool result = false;
-    t = malloc(sizeof(t_context_t));
+    for (int cnt = 0; cnt < TEST_TRIES; ++cnt) {
+        printf("Testing %s...(%d/%d)\n\n", text, cnt, TEST_TRIES);
+        result = doit_parallel(mode, threads);
+        printf("\033[A\033[2K\033[A\033[2K");
+        if (dudect_sequential) {
+            printf("%s: decided after %.0f of %d measurements\n", text,
+                   stats_count(&shared.total),
+                   shared.batches * (N_MEASURES - DROP_SIZE * 2));
+        }
+        if (result)
+            break;
+    }
+    return result;
+}
 
+static bool test_const(char *text, int mode)
+{
+    int threads = dudect_threads;
+    if (threads <= 0)
+        threads = (int) sysconf(_SC_NPROCESSORS_ONLN);
+    if (threads > MAX_THREADS)
+        threads = MAX_THREADS;
+    if (threads > 1 || dudect_sequential)
+        return test_const_parallel(text, mode, threads);
+
+    /* As in the original fixture, a single thread only checks that the
+     * operation behaves, and the verdict is that of the last batch.
+     */
+    bool result = false;
     for (int cnt = 0; cnt < TEST_TRIES; ++cnt) {
         printf("Testing %s...(%d/%d)\n\n", text, cnt, TEST_TRIES);
-        init_once();
+        init_dut();
         for (int i = 0; i < ENOUGH_MEASURE / (N_MEASURES - DROP_SIZE * 2) + 1;
              ++i)
-            result = doit(mode);
+            result = measure_batch(NULL, mode, false);
         printf("\033[A\033[2K\033[A\033[2K");
         if (result)
             break;
     }
-    free(t);
     return result;
 }
 
+/* Execution times drawn from a fixed seed, so that the self-checks do not
+ * depend on the machine: a few cycles of noise, with many ties, and now and
+ * then an interruption.  Class 1 inputs take leak more cycles.
+ */
+typedef struct {
+    uint64_t state;
+    int64_t leak;
+} synth_t;
+
+static void synth_batch(synth_t *g, int64_t *exec_times, uint8_t *classes)
+{
+    memset(exec_times, 0, N_MEASURES * sizeof(int64_t));
+    for (size_t i = 0; i < N_MEASURES; i++) {
+        /* xorshift64 */
+        uint64_t r = g->state;
+        r ^= r << 13;
+        r ^= r >> 7;
+        r ^= r << 17;
+        g->state = r;
+
+        classes[i] = r & 1;
+        if (i < DROP_SIZE || i >= N_MEASURES - DROP_SIZE)
+            continue;
+        int64_t x = 1000;
+        for (int k = 0; k < 4; k++)
+            x += (r >> (8 + 6 * k)) & 63;
+        if (!((r >> 40) & 127))
+            x += 20000;
+        exec_times[i] = x + classes[i] * g->leak;
+    }
+}
+
+static int cmp_int64(const void *a, const void *b)
+{
+    int64_t x = *(const int64_t *) a, y = *(const int64_t *) b;
+    return (x > y) - (x < y);
+}
+
+/* Check one synthetic test against the straightforward computation: sorting
+ * the measurements for their percentiles, and pushing every sample into
+ * each test it belongs to.
+ */
+static bool check_statistics(synth_t *g)
+{
+    int64_t exec_times[N_MEASURES], scratch[N_MEASURES];
+    uint8_t classes[N_MEASURES];
+    int64_t percentiles[DUDECT_NUMBER_PERCENTILES];
+    stats_t s = {.percentiles = percentiles};
+    t_context_t ref[DUDECT_TESTS];
+    size_t size = N_MEASURES - DROP_SIZE * 2;
+
+    stats_init(&s);
+    for (size_t i = 0; i < DUDECT_TESTS; i++)
+        t_init(&ref[i]);
+
+    for (int batch = 0; batch <= ENOUGH_BATCHES; batch++) {
+        synth_batch(g, exec_times, classes);
+
+        int64_t selected[DUDECT_NUMBER_PERCENTILES];
+        memcpy(scratch, exec_times, sizeof(scratch));
+        prepare_percentiles(selected, scratch);
+        memcpy(scratch, exec_times + DROP_SIZE, size * sizeof(int64_t));
+        qsort(scratch, size, sizeof(int64_t), cmp_int64);
+        for (size_t i = 0; i < DUDECT_NUMBER_PERCENTILES; i++) {
+            double which = 1 - (pow(0.5, 10 * (double) (i + 1) /
+                                             DUDECT_NUMBER_PERCENTILES));
+            if (selected[i] != scratch[percentile_rank(which, size)])
+                return false;
+        }
+
+        if (!batch) {
+            memcpy(percentiles, selected, sizeof(percentiles));
+            continue;
+        }
+        update_statistics(&s, exec_times, classes);
+        for (size_t i = 10; i < N_MEASURES; i++) {
+            int64_t x = exec_times[i];
+            if (x <= 0)
+                continue;
+            t_push(&ref[0], x, classes[i]);
+            for (size_t crop = 0; crop < DUDECT_NUMBER_PERCENTILES; crop++) {
+                if (x < percentiles[crop])
+                    t_push(&ref[crop + 1], x, classes[i]);
+            }
+        }
+    }
+
+    for (size_t i = 0; i < DUDECT_TESTS; i++) {
+        t_context_t *test = &s.tests[i];
+        if (test->n[0] != ref[i].n[0] || test->n[1] != ref[i].n[1])
+            return false;
+        if (test->n[0] < 2 || test->n[1] < 2)
+            continue;
+        double t_value = t_compute(test), t_ref = t_compute(&ref[i]);
+        if (fabs(t_value - t_ref) > 1e-6 * fmax(1, fabs(t_ref)))
+            return false;
+    }
+    return true;
+}
+
+bool dudect_check_statistics(void)
+{
+    for (uint64_t seed = 1; seed <= 10; seed++) {
+        synth_t constant = {.state = seed * 0x9e3779b97f4a7c15, .leak = 0};
+        synth_t leaky = {.state = seed * 0x9e3779b97f4a7c15, .leak = 32};
+        if (!check_statistics(&constant) || !check_statistics(&leaky))
+            return false;
+    }
+    return true;
+}
+
+/* Run a synthetic test in sequential mode, and return its verdict if it is
+ * reached before the last batch, or 0.
+ */
+static int early_verdict(synth_t *g)
+{
+    int64_t exec_times[N_MEASURES];
+    uint8_t classes[N_MEASURES];
+    int64_t percentiles[DUDECT_NUMBER_PERCENTILES];
+    stats_t s = {.percentiles = percentiles};
+
+    stats_init(&s);
+    synth_batch(g, exec_times, classes);
+    prepare_percentiles(percentiles, exec_times);
+    for (int batch = 1; batch < ENOUGH_BATCHES; batch++) {
+        synth_batch(g, exec_times, classes);
+        update_statistics(&s, exec_times, classes);
+        double n = stats_count(&s);
+        if (n < ENOUGH_SEQUENTIAL)
+            continue;
+        int verdict = sequential_verdict(n, fabs(t_compute(max_test(&s))));
+        if (verdict)
+            return verdict;
+    }
+    return 0;
+}
+
+bool dudect_check_sequential(void)
+{
+    for (uint64_t seed = 1; seed <= 10; seed++) {
+        synth_t constant = {.state = seed * 0x9e3779b97f4a7c15, .leak = 0};
+        synth_t leaky = {.state = seed * 0x9e3779b97f4a7c15, .leak = 32};
+        if (early_verdict(&constant) != -1 || early_verdict(&leaky) != 1)
+            return false;
+    }
+    return true;
+}
+
 #define DUT_FUNC_IMPL(op)                \
     bool is_##op##_const(void)           \
     {                                    \
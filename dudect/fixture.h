@@ -4,6 +4,29 @@
 #include <stdbool.h>
 #include "constant.h"
 
+/* Number of threads measuring each test in parallel, 0 for one per online
+ * CPU.  A single thread only checks that the operation behaves, unless
+ * dudect_sequential is set; otherwise the t-tests are run as well.
+ */
+extern int dudect_threads;
+
+/* Run the t-tests and decide as soon as they are conclusive, rather than
+ * after a fixed number of measurements, and print how many were needed.
+ */
+extern int dudect_sequential;
+
+/* Check the percentiles and t-tests against sorting the measurements and
+ * pushing each sample into every test it belongs to, on synthetic ones.
+ * Return false if they differ.
+ */
+bool dudect_check_statistics(void);
+
+/* Check that the sequential mode stops early on synthetic measurements,
+ * accepting a constant-time operation and rejecting a leaky one.  Return
+ * false if it does not.
+ */
+bool dudect_check_sequential(void);
+
 /* Interface to test if function is constant */
 #define _(x) bool is_##x##_const(void);
 DUT_FUNCS
@@ -7,10 +7,11 @@ typedef struct {
     double mean[2];
     double m2[2];
     double n[2];
-    int64_t *percentiles;
 } t_context_t;
 
 void t_push(t_context_t *ctx, double x, uint8_t class);
+/* Add the samples pushed to src to dst, as if they had been pushed to it */
+void t_merge(t_context_t *dst, const t_context_t *src);
 double t_compute(t_context_t *ctx);
 void t_init(t_context_t *ctx);
 
@@ -0,0 +1,315 @@
+/* Event loop dispatching ready file descriptors and expired timers */
+
+#include <errno.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#if defined(__linux__)
+#include <sys/epoll.h>
+#define HAVE_EPOLL 1
+#endif
+
+#include "event.h"
+#include "timing.h"
+
+/* Most events taken from the kernel per wakeup */
+#define EVENT_BATCH 64
+
+typedef struct {
+    event_func_t fn; /* NULL when the descriptor is not watched */
+    void *arg;
+    int events;
+    bool polled; /* False for descriptors that are always ready */
+} event_reg_t;
+
+typedef struct {
+    int id; /* -1 for a free slot */
+    int64_t deadline_ns;
+    int64_t interval_ns; /* 0 for one-shot timers */
+    timer_func_t fn;
+    void *arg;
+} event_timer_t;
+
+struct __event_loop {
+    int epfd; /* -1 when falling back to poll */
+    event_reg_t *regs; /* Indexed by descriptor */
+    int nregs;
+    int unpolled; /* Number of watched descriptors that are always ready */
+    event_timer_t *timers;
+    int ntimers;
+    int next_timer_id;
+    struct pollfd *pfds; /* Scratch array of the poll backend */
+    int npfds;
+};
+
+event_loop_t *event_loop_new(void)
+{
+    event_loop_t *loop = calloc(1, sizeof(event_loop_t));
+    if (!loop)
+        return NULL;
+    loop->epfd = -1;
+#ifdef HAVE_EPOLL
+    loop->epfd = epoll_create1(EPOLL_CLOEXEC);
+#endif
+    return loop;
+}
+
+void event_loop_free(event_loop_t *loop)
+{
+    if (!loop)
+        return;
+    if (loop->epfd >= 0)
+        close(loop->epfd);
+    free(loop->regs);
+    free(loop->timers);
+    free(loop->pfds);
+    free(loop);
+}
+
+#ifdef HAVE_EPOLL
+static uint32_t epoll_mask(int events)
+{
+    return (events & EVENT_READ ? EPOLLIN : 0) |
+           (events & EVENT_WRITE ? EPOLLOUT : 0);
+}
+#endif
+
+bool event_add(event_loop_t *loop,
+               int fd,
+               int events,
+               event_func_t fn,
+               void *arg)
+{
+    if (fd < 0 || !fn)
+        return false;
+
+    if (fd >= loop->nregs) {
+        int n = loop->nregs ? loop->nregs : 16;
+        while (n <= fd)
+            n *= 2;
+        event_reg_t *regs = realloc(loop->regs, n * sizeof(event_reg_t));
+        if (!regs)
+            return false;
+        memset(regs + loop->nregs, 0,
+               (n - loop->nregs) * sizeof(event_reg_t));
+        loop->regs = regs;
+        loop->nregs = n;
+    }
+
+    event_reg_t *reg = &loop->regs[fd];
+    bool polled = true;
+#ifdef HAVE_EPOLL
+    if (loop->epfd >= 0) {
+        struct epoll_event ev = {.events = epoll_mask(events), .data.fd = fd};
+        bool was_polled = reg->fn && reg->polled;
+        if (epoll_ctl(loop->epfd, was_polled ? EPOLL_CTL_MOD : EPOLL_CTL_ADD,
+                      fd, &ev) != 0) {
+            /* epoll refuses regular files, which never block */
+            if (errno != EPERM)
+                return false;
+            polled = false;
+        }
+    }
+#endif
+    if (reg->fn && !reg->polled)
+        loop->unpolled--;
+    if (!polled)
+        loop->unpolled++;
+
+    reg->fn = fn;
+    reg->arg = arg;
+    reg->events = events;
+    reg->polled = polled;
+    return true;
+}
+
+void event_del(event_loop_t *loop, int fd)
+{
+    if (fd < 0 || fd >= loop->nregs || !loop->regs[fd].fn)
+        return;
+
+    event_reg_t *reg = &loop->regs[fd];
+#ifdef HAVE_EPOLL
+    if (loop->epfd >= 0 && reg->polled)
+        epoll_ctl(loop->epfd, EPOLL_CTL_DEL, fd, NULL);
+#endif
+    if (!reg->polled)
+        loop->unpolled--;
+    reg->fn = NULL;
+}
+
+int event_timer_add(event_loop_t *loop,
+                    long interval_ms,
+                    bool repeat,
+                    timer_func_t fn,
+                    void *arg)
+{
+    int i;
+    for (i = 0; i < loop->ntimers && loop->timers[i].id >= 0; i++)
+        ;
+    if (i == loop->ntimers) {
+        int n = loop->ntimers ? 2 * loop->ntimers : 4;
+        event_timer_t *timers =
+            realloc(loop->timers, n * sizeof(event_timer_t));
+        if (!timers)
+            return -1;
+        for (int j = loop->ntimers; j < n; j++)
+            timers[j].id = -1;
+        loop->timers = timers;
+        loop->ntimers = n;
+    }
+
+    event_timer_t *t = &loop->timers[i];
+    t->id = loop->next_timer_id++;
+    t->interval_ns = (int64_t) interval_ms * 1000000;
+    t->deadline_ns = timing_ns() + t->interval_ns;
+    if (!repeat)
+        t->interval_ns = 0;
+    t->fn = fn;
+    t->arg = arg;
+    return t->id;
+}
+
+void event_timer_del(event_loop_t *loop, int id)
+{
+    for (int i = 0; i < loop->ntimers; i++) {
+        if (loop->timers[i].id == id && id >= 0)
+            loop->timers[i].id = -1;
+    }
+}
+
+/* Shorten timeout_ms so that the earliest timer is not missed */
+static int timer_timeout(const event_loop_t *loop, int timeout_ms)
+{
+    int64_t now = timing_ns();
+    for (int i = 0; i < loop->ntimers; i++) {
+        if (loop->timers[i].id < 0)
+            continue;
+        int64_t wait_ns = loop->timers[i].deadline_ns - now;
+        int ms = wait_ns > 0 ? (int) ((wait_ns + 999999) / 1000000) : 0;
+        if (timeout_ms < 0 || ms < timeout_ms)
+            timeout_ms = ms;
+    }
+    return timeout_ms;
+}
+
+static int run_timers(event_loop_t *loop)
+{
+    int cnt = 0;
+    int64_t now = timing_ns();
+    /* Timers may be added or deleted by the callbacks */
+    for (int i = 0; i < loop->ntimers; i++) {
+        event_timer_t *t = &loop->timers[i];
+        if (t->id < 0 || t->deadline_ns > now)
+            continue;
+        if (t->interval_ns) {
+            t->deadline_ns += t->interval_ns;
+            /* Skip the ticks missed while the loop was busy */
+            if (t->deadline_ns <= now)
+                t->deadline_ns = now + t->interval_ns;
+        } else {
+            t->id = -1;
+        }
+        t->fn(t->arg);
+        cnt++;
+    }
+    return cnt;
+}
+
+/* Call the handler of fd, unless an earlier callback removed it */
+static int dispatch(event_loop_t *loop, int fd, int events)
+{
+    if (fd >= loop->nregs || !loop->regs[fd].fn)
+        return 0;
+    event_reg_t *reg = &loop->regs[fd];
+    events &= reg->events;
+    if (!events)
+        return 0;
+    reg->fn(fd, events, reg->arg);
+    return 1;
+}
+
+#ifdef HAVE_EPOLL
+static int wait_epoll(event_loop_t *loop, int timeout_ms)
+{
+    struct epoll_event evs[EVENT_BATCH];
+    int n = epoll_wait(loop->epfd, evs, EVENT_BATCH, timeout_ms);
+    if (n < 0)
+        return errno == EINTR ? 0 : -1;
+
+    int cnt = 0;
+    for (int i = 0; i < n; i++) {
+        /* Hangups and errors are reported to the handler as readiness */
+        uint32_t e = evs[i].events;
+        int events = (e & (EPOLLIN | EPOLLHUP | EPOLLERR) ? EVENT_READ : 0) |
+                     (e & (EPOLLOUT | EPOLLHUP | EPOLLERR) ? EVENT_WRITE : 0);
+        cnt += dispatch(loop, evs[i].data.fd, events);
+    }
+    return cnt;
+}
+#endif
+
+static int wait_poll(event_loop_t *loop, int timeout_ms)
+{
+    int n = 0;
+    for (int fd = 0; fd < loop->nregs; fd++) {
+        const event_reg_t *reg = &loop->regs[fd];
+        if (!reg->fn || !reg->polled)
+            continue;
+        if (n == loop->npfds) {
+            int size = loop->npfds ? 2 * loop->npfds : 16;
+            struct pollfd *pfds =
+                realloc(loop->pfds, size * sizeof(struct pollfd));
+            if (!pfds)
+                return -1;
+            loop->pfds = pfds;
+            loop->npfds = size;
+        }
+        loop->pfds[n].fd = fd;
+        loop->pfds[n].events = (reg->events & EVENT_READ ? POLLIN : 0) |
+                               (reg->events & EVENT_WRITE ? POLLOUT : 0);
+        loop->pfds[n].revents = 0;
+        n++;
+    }
+
+    if (poll(loop->pfds, n, timeout_ms) < 0)
+        return errno == EINTR ? 0 : -1;
+
+    int cnt = 0;
+    for (int i = 0; i < n; i++) {
+        short e = loop->pfds[i].revents;
+        int events = (e & (POLLIN | POLLHUP | POLLERR) ? EVENT_READ : 0) |
+                     (e & (POLLOUT | POLLHUP | POLLERR) ? EVENT_WRITE : 0);
+        if (events)
+            cnt += dispatch(loop, loop->pfds[i].fd, events);
+    }
+    return cnt;
+}
+
+int event_run_once(event_loop_t *loop, int timeout_ms)
+{
+    timeout_ms = timer_timeout(loop, timeout_ms);
+    /* Do not sleep while some descriptor is ready anyway */
+    if (loop->unpolled)
+        timeout_ms = 0;
+
+    int cnt;
+#ifdef HAVE_EPOLL
+    if (loop->epfd >= 0)
+        cnt = wait_epoll(loop, timeout_ms);
+    else
+#endif
+        cnt = wait_poll(loop, timeout_ms);
+    if (cnt < 0)
+        return -1;
+
+    for (int fd = 0; loop->unpolled && fd < loop->nregs; fd++) {
+        if (loop->regs[fd].fn && !loop->regs[fd].polled)
+            cnt += dispatch(loop, fd, loop->regs[fd].events);
+    }
+
+    return cnt + run_timers(loop);
+}
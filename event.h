@@ -0,0 +1,57 @@
+#ifndef LAB0_EVENT_H
+#define LAB0_EVENT_H
+
+#include <stdbool.h>
+
+/* Event loop dispatching ready file descriptors and expired timers.
+ *
+ * Backed by epoll where available, and by poll otherwise.  Descriptors that
+ * cannot be polled, such as regular files, are always considered ready.
+ * Every loop is independent, so each thread may run its own.
+ */
+
+typedef struct __event_loop event_loop_t;
+
+/* Interest and readiness flags */
+#define EVENT_READ 1
+#define EVENT_WRITE 2
+
+/* Called with the ready subset of the events fd was registered for */
+typedef void (*event_func_t)(int fd, int events, void *arg);
+
+typedef void (*timer_func_t)(void *arg);
+
+/* Return NULL when the loop cannot be created */
+event_loop_t *event_loop_new(void);
+
+void event_loop_free(event_loop_t *loop);
+
+/* Watch fd for events, replacing any previous registration of fd */
+bool event_add(event_loop_t *loop,
+               int fd,
+               int events,
+               event_func_t fn,
+               void *arg);
+
+/* Stop watching fd.  Must be called before fd is closed */
+void event_del(event_loop_t *loop, int fd);
+
+/* Call fn after interval_ms milliseconds, and then every interval_ms
+ * milliseconds if repeat is set.  Return an identifier for event_timer_del,
+ * or -1 on failure.
+ */
+int event_timer_add(event_loop_t *loop,
+                    long interval_ms,
+                    bool repeat,
+                    timer_func_t fn,
+                    void *arg);
+
+void event_timer_del(event_loop_t *loop, int id);
+
+/* Wait up to timeout_ms milliseconds (-1 = no limit) for events, then
+ * dispatch every ready descriptor and expired timer.
+ * Return the number of callbacks made, or -1 on error.
+ */
+int event_run_once(event_loop_t *loop, int timeout_ms);
+
+#endif /* LAB0_EVENT_H */
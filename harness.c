@@ -2,11 +2,15 @@
 
 #include <setjmp.h>
 #include <signal.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/time.h>
+#include <time.h>
 #include <unistd.h>
 
+#include "metrics.h"
 #include "report.h"
 
 /* Our program needs to use regular malloc/free */
@@ -35,17 +39,57 @@
 typedef struct __block_element {
     struct __block_element *next, *prev;
     size_t payload_size;
+    const void *site;    /* Code address that requested the block */
     size_t magic_header; /* Marker to see if block seems legitimate */
     unsigned char payload[0];
     /* Also place magic number at tail of every block */
 } block_element_t;
 
-static block_element_t *allocated = NULL;
-static size_t allocated_count = 0;
+/* Each thread tracks the blocks it allocates.  dudect workers build and free
+ * a queue per measurement; shared, this list would need a lock around every
+ * allocation, which would serialize them and time the lock with the queue.
+ * A block must be freed by the thread that allocated it, and
+ * allocation_check() only counts the blocks of the calling thread, which for
+ * the main thread are all the blocks of the commands.
+ */
+static __thread block_element_t *allocated = NULL;
+static __thread size_t allocated_count = 0;
+
+/* Set in measurement workers, whose allocations never fail and are not
+ * profiled, as both rely on state shared with the main thread.
+ */
+static __thread bool worker_mode = false;
+
+/* First error met by a worker since it was last collected.  Workers cannot
+ * report events nor raise the error flag, which belong to the main thread.
+ */
+static __thread char worker_msg[MAX_CHAR];
 
 /* Percent probability of malloc failure */
 int fail_probability = 0;
 
+/* Seed of the stream deciding probabilistic failures */
+int fail_seed = 1;
+
+/* Fail the Nth allocation counted from when the schedule was last set */
+int fail_nth = 0;
+
+/* Fail every Kth allocation counted from when the schedule was last set */
+int fail_every = 0;
+
+/* Poison the payload of every Nth block (0 = never, 1 = every block).  The
+ * count is per thread, so that workers neither race on it nor shift which
+ * blocks of the main thread get poisoned.
+ */
+int poison_interval = 1;
+static __thread int poison_cnt = 0;
+
+/* State of fault injection, refreshed by reset_fault_injection() */
+static bool fault_armed = false;
+static uint32_t fault_state = 1;
+static unsigned long fault_alloc_cnt = 0;
+static int fault_every_left = 0;
+
 static bool cautious_mode = true;
 static bool noallocate_mode = false;
 static bool error_occurred = false;
@@ -53,6 +97,10 @@ static char *error_message = "";
 
 static int time_limit = 1;
 
+/* Time budget of each risky operation in microseconds (0: use time_limit) */
+int time_limit_us = 0;
+static struct timespec time_start;
+
 /* Data for managing exceptions */
 static jmp_buf env;
 static volatile sig_atomic_t jmp_ready = false;
@@ -60,11 +108,71 @@ static bool time_limited = false;
 
 /* Internal functions */
 
+/* Marsaglia's xorshift32.  Cheap, and replays the same failures for a seed */
+static inline uint32_t fault_next()
+{
+    uint32_t x = fault_state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    return fault_state = x;
+}
+
 /* Should this allocation fail? */
-static bool fail_allocation()
+static inline bool fail_allocation()
+{
+    if (__builtin_expect(!fault_armed, 1))
+        return false;
+
+    fault_alloc_cnt++;
+    if (fail_nth > 0 && fault_alloc_cnt == (unsigned long) fail_nth)
+        return true;
+    if (fail_every > 0 && --fault_every_left == 0) {
+        fault_every_left = fail_every;
+        return true;
+    }
+    if (fail_probability <= 0)
+        return false;
+    /* Scale to [0, 100) by multiply and shift, avoiding division */
+    return (((uint64_t) fault_next() * 100) >> 32) <
+           (uint64_t) fail_probability;
+}
+
+/* Should this block be filled with FILLCHAR?
+ * Header and footer magic numbers are checked regardless, so sampling only
+ * trades the chance of catching use of uninitialized or freed payloads for
+ * memory bandwidth.
+ */
+static inline bool poison_block()
+{
+    if (poison_interval == 1)
+        return true;
+    if (poison_interval <= 0 || ++poison_cnt < poison_interval)
+        return false;
+    poison_cnt = 0;
+    return true;
+}
+
+/* Report an error of the harness, or keep it for the main thread if the
+ * caller is a worker.  Errors other than warnings are checked by
+ * error_check().
+ */
+static void harness_error(message_t msg, char *fmt, ...)
 {
-    double weight = (double) random() / RAND_MAX;
-    return (weight < 0.01 * fail_probability);
+    char buf[MAX_CHAR];
+    va_list ap;
+    va_start(ap, fmt);
+    vsnprintf(buf, sizeof(buf), fmt, ap);
+    va_end(ap);
+
+    if (worker_mode) {
+        if (!worker_msg[0])
+            strncpy(worker_msg, buf, sizeof(worker_msg) - 1);
+        return;
+    }
+    if (msg != MSG_WARN)
+        error_occurred = true;
+    report_event(msg, "%s", buf);
 }
 
 /* Find header of block, given its payload.
@@ -73,8 +181,7 @@ static bool fail_allocation()
 static block_element_t *find_header(void *p)
 {
     if (!p) {
-        report_event(MSG_ERROR, "Attempting to free null block");
-        error_occurred = true;
+        harness_error(MSG_ERROR, "Attempting to free null block");
     }
 
     block_element_t *b =
@@ -88,19 +195,17 @@ static block_element_t *find_header(void *p)
             ab = ab->next;
         }
         if (!found) {
-            report_event(MSG_ERROR,
-                         "Attempted to free unallocated block.  Address = %p",
-                         p);
-            error_occurred = true;
+            harness_error(MSG_ERROR,
+                          "Attempted to free unallocated block.  Address = %p",
+                          p);
         }
     }
 
     if (b->magic_header != MAGICHEADER) {
-        report_event(
+        harness_error(
             MSG_ERROR,
             "Attempted to free unallocated or corrupted block.  Address = %p",
             p);
-        error_occurred = true;
     }
 
     return b;
@@ -117,14 +222,15 @@ static size_t *find_footer(block_element_t *b)
 
 /* Implementation of application functions */
 
-void *test_malloc(size_t size)
+/* Allocate a block on behalf of the code at address site */
+static void *alloc_block(size_t size, const void *site)
 {
     if (noallocate_mode) {
-        report_event(MSG_FATAL, "Calls to malloc disallowed");
+        harness_error(MSG_FATAL, "Calls to malloc disallowed");
         return NULL;
     }
 
-    if (fail_allocation()) {
+    if (!worker_mode && fail_allocation()) {
         report_event(MSG_WARN, "Malloc returning NULL");
         return NULL;
     }
@@ -132,17 +238,20 @@ void *test_malloc(size_t size)
     block_element_t *new_block =
         malloc(size + sizeof(block_element_t) + sizeof(size_t));
     if (!new_block) {
-        report_event(MSG_FATAL, "Couldn't allocate any more memory");
-        error_occurred = true;
+        harness_error(MSG_FATAL, "Couldn't allocate any more memory");
+        return NULL;
     }
 
     // cppcheck-suppress nullPointerRedundantCheck
     new_block->magic_header = MAGICHEADER;
     // cppcheck-suppress nullPointerRedundantCheck
     new_block->payload_size = size;
+    // cppcheck-suppress nullPointerRedundantCheck
+    new_block->site = site;
     *find_footer(new_block) = MAGICFOOTER;
     void *p = (void *) &new_block->payload;
-    memset(p, FILLCHAR, size);
+    if (poison_block())
+        memset(p, FILLCHAR, size);
     // cppcheck-suppress nullPointerRedundantCheck
     new_block->next = allocated;
     // cppcheck-suppress nullPointerRedundantCheck
@@ -152,10 +261,17 @@ void *test_malloc(size_t size)
         allocated->prev = new_block;
     allocated = new_block;
     allocated_count++;
+    if (!worker_mode)
+        heap_site_alloc(site, NULL, size);
 
     return p;
 }
 
+void *test_malloc(size_t size)
+{
+    return alloc_block(size, __builtin_return_address(0));
+}
+
 // cppcheck-suppress unusedFunction
 void *test_calloc(size_t nelem, size_t elsize)
 {
@@ -163,15 +279,16 @@ void *test_calloc(size_t nelem, size_t elsize)
      * https://danluu.com/malloc-tutorial/
      */
     size_t size = nelem * elsize;  // TODO: check for overflow
-    void *ptr = test_malloc(size);
-    memset(ptr, 0, size);
+    void *ptr = alloc_block(size, __builtin_return_address(0));
+    if (ptr)
+        memset(ptr, 0, size);
     return ptr;
 }
 
 void test_free(void *p)
 {
     if (noallocate_mode) {
-        report_event(MSG_FATAL, "Calls to free disallowed");
+        harness_error(MSG_FATAL, "Calls to free disallowed");
         return;
     }
 
@@ -181,15 +298,15 @@ void test_free(void *p)
     block_element_t *b = find_header(p);
     size_t footer = *find_footer(b);
     if (footer != MAGICFOOTER) {
-        report_event(MSG_ERROR,
-                     "Corruption detected in block with address %p when "
-                     "attempting to free it",
-                     p);
-        error_occurred = true;
+        harness_error(MSG_ERROR,
+                      "Corruption detected in block with address %p when "
+                      "attempting to free it",
+                      p);
     }
     b->magic_header = MAGICFREE;
     *find_footer(b) = MAGICFREE;
-    memset(p, FILLCHAR, b->payload_size);
+    if (poison_block())
+        memset(p, FILLCHAR, b->payload_size);
 
     /* Unlink from list */
     block_element_t *bn = b->next;
@@ -201,6 +318,8 @@ void test_free(void *p)
     if (bn)
         bn->prev = bp;
 
+    if (!worker_mode)
+        heap_site_free(b->site, NULL, b->payload_size);
     free(b);
     allocated_count--;
 }
@@ -209,13 +328,20 @@ void test_free(void *p)
 char *test_strdup(const char *s)
 {
     size_t len = strlen(s) + 1;
-    void *new = test_malloc(len);
+    void *new = alloc_block(len, __builtin_return_address(0));
     if (!new)
         return NULL;
 
     return memcpy(new, s, len);
 }
 
+void harness_add_metrics()
+{
+    metrics_add("qtest_harness_live_blocks",
+                "Blocks allocated by test_malloc and not yet freed",
+                METRIC_GAUGE, &allocated_count);
+}
+
 size_t allocation_check()
 {
     return allocated_count;
@@ -223,6 +349,19 @@ size_t allocation_check()
 
 /* Implementation of functions for testing */
 
+/* Apply the current fault-injection parameters.
+ * Reseed the failure stream and restart counting allocations, so that the
+ * same trace always fails the same allocations.
+ */
+void reset_fault_injection()
+{
+    fault_armed = fail_probability > 0 || fail_nth > 0 || fail_every > 0;
+    fault_alloc_cnt = 0;
+    fault_every_left = fail_every;
+    /* xorshift gets stuck at zero */
+    fault_state = fail_seed ? (uint32_t) fail_seed : (uint32_t) random() | 1;
+}
+
 /* Set/unset cautious mode.
  * In this mode, makes extra sure any block to be freed is currently allocated.
  */
@@ -231,6 +370,27 @@ void set_cautious_mode(bool cautious)
     cautious_mode = cautious;
 }
 
+/* Set/unset worker mode for the calling thread */
+void set_worker_mode(bool worker)
+{
+    worker_mode = worker;
+}
+
+bool worker_error(char *buf, size_t size)
+{
+    if (!worker_msg[0])
+        return false;
+    snprintf(buf, size, "%s", worker_msg);
+    worker_msg[0] = '\0';
+    return true;
+}
+
+void report_worker_error(const char *msg)
+{
+    report_event(MSG_ERROR, "%s", msg);
+    error_occurred = true;
+}
+
 /* Set/unset restricted allocation mode.
  * In this mode, calls to malloc and free are disallowed.
  */
@@ -247,6 +407,29 @@ bool error_check()
     return e;
 }
 
+static long time_budget_us()
+{
+    return time_limit_us > 0 ? time_limit_us : time_limit * 1000000L;
+}
+
+/* Arm a one-shot SIGALRM with microsecond resolution, or disarm it */
+static void set_timer(long usec)
+{
+    struct itimerval it = {
+        .it_interval = {0, 0},
+        .it_value = {usec / 1000000, usec % 1000000},
+    };
+    setitimer(ITIMER_REAL, &it, NULL);
+}
+
+static long elapsed_us()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - time_start.tv_sec) * 1000000L +
+           (now.tv_nsec - time_start.tv_nsec) / 1000;
+}
+
 /* Prepare for a risky operation using setjmp.
  * Function returns true for initial return, false for error return
  */
@@ -256,7 +439,7 @@ bool exception_setup(bool limit_time)
         /* Got here from longjmp */
         jmp_ready = false;
         if (time_limited) {
-            alarm(0);
+            set_timer(0);
             time_limited = false;
         }
 
@@ -269,7 +452,8 @@ bool exception_setup(bool limit_time)
     /* Got here from initial call */
     jmp_ready = true;
     if (limit_time) {
-        alarm(time_limit);
+        clock_gettime(CLOCK_MONOTONIC, &time_start);
+        set_timer(time_budget_us());
         time_limited = true;
     }
     return true;
@@ -279,8 +463,13 @@ bool exception_setup(bool limit_time)
 void exception_cancel()
 {
     if (time_limited) {
-        alarm(0);
+        set_timer(0);
         time_limited = false;
+        if (time_limit_us > 0) {
+            long used = elapsed_us();
+            report(1, "Used %ld us of %ld us time budget (%.1f%%)", used,
+                   time_budget_us(), 100.0 * used / time_budget_us());
+        }
     }
 
     jmp_ready = false;
@@ -18,18 +18,55 @@ char *test_strdup(const char *s);
 
 #ifdef INTERNAL
 
-/* Report number of allocated blocks */
+/* Report number of blocks allocated by the calling thread */
 size_t allocation_check();
 
+/* Register the allocation counters with the metrics registry */
+void harness_add_metrics();
+
 /* Probability of malloc failing, expressed as percent */
 extern int fail_probability;
 
+/* Seed of the failure stream.  Zero picks a different seed on every reset */
+extern int fail_seed;
+
+/* Fail the Nth allocation after the last reset (0 = disabled) */
+extern int fail_nth;
+
+/* Fail every Kth allocation after the last reset (0 = disabled) */
+extern int fail_every;
+
+/* Apply changed fault-injection parameters.  Must be called after changing
+ * any of the variables above.
+ */
+void reset_fault_injection();
+
+/* Fill the payload of every Nth allocated and freed block with a marker byte.
+ * 1 poisons every block, 0 disables poisoning.
+ */
+extern int poison_interval;
+
 /*
  * Set/unset cautious mode.
  * In this mode, makes extra sure any block to be freed is currently allocated.
  */
 void set_cautious_mode(bool cautious);
 
+/*
+ * Set/unset worker mode for the calling thread.
+ * Threads measuring in parallel keep their blocks apart from other threads,
+ * and their allocations neither fail nor show up in the heap profile.
+ */
+void set_worker_mode(bool worker);
+
+/* Copy into buf the first error of the harness met by the calling worker
+ * since the last call, and return true, or return false if there was none.
+ */
+bool worker_error(char *buf, size_t size);
+
+/* Report an error met by a worker, from the main thread */
+void report_worker_error(const char *msg);
+
 /*
  * Set/unset restricted allocation mode.
  * In this mode, calls to malloc and free are disallowed.
@@ -39,6 +76,12 @@ void set_noallocate_mode(bool noallocate);
 /* Return whether any errors have occurred since last time checked */
 bool error_check();
 
+/* Time budget of each risky operation in microseconds.
+ * 0 selects the default limit of one second.  When set, the time spent by
+ * each operation is reported as it completes.
+ */
+extern int time_limit_us;
+
 /* Prepare for a risky operation using setjmp.
  * Function returns true for initial return, false for error return
  */
@@ -0,0 +1,192 @@
+/* Incremental, allocation-free parser of HTTP requests */
+
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include "http.h"
+
+enum {
+    HTTP_REQUEST_LINE, /* Waiting for the request line */
+    HTTP_HEADERS,      /* Waiting for the next header line */
+};
+
+void http_parser_init(http_parser_t *p)
+{
+    memset(p, 0, sizeof(http_parser_t));
+    p->state = HTTP_REQUEST_LINE;
+}
+
+static int hex_value(char c)
+{
+    if (c >= '0' && c <= '9')
+        return c - '0';
+    if (c >= 'a' && c <= 'f')
+        return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F')
+        return c - 'A' + 10;
+    return -1;
+}
+
+/* Decode the '%' escapes of the string s in place */
+static void url_decode(char *s)
+{
+    char *d = s;
+    for (; *s; s++) {
+        int hi, lo;
+        if (*s == '%' && (hi = hex_value(s[1])) >= 0 &&
+            (lo = hex_value(s[2])) >= 0) {
+            *d++ = (char) (hi << 4 | lo);
+            s += 2;
+        } else {
+            *d++ = *s;
+        }
+    }
+    *d = '\0';
+}
+
+/* Start of the next field of the line, after spaces, or NULL */
+static char *next_field(char *s, char *end)
+{
+    while (s < end && (*s == ' ' || *s == '\t'))
+        s++;
+    return s < end ? s : NULL;
+}
+
+/* Parse "METHOD URI [VERSION]", ending at end */
+static bool parse_request_line(http_parser_t *p,
+                               char *buf,
+                               char *line,
+                               char *end)
+{
+    char *method = next_field(line, end);
+    char *sp = method ? memchr(method, ' ', end - method) : NULL;
+    char *uri = sp ? next_field(sp, end) : NULL;
+    if (!uri)
+        return false;
+
+    p->close = false;
+    p->range = false;
+    p->body_left = 0;
+
+    char *uri_end = memchr(uri, ' ', end - uri);
+    char *version = uri_end ? next_field(uri_end, end) : NULL;
+    if (!uri_end)
+        uri_end = end;
+    p->http11 =
+        version && end - version >= 8 && !memcmp(version, "HTTP/1.1", 8);
+
+    /* The query is dropped, and the rest decoded */
+    *uri_end = '\0';
+    char *query = memchr(uri, '?', uri_end - uri);
+    if (query)
+        *query = '\0';
+    url_decode(uri);
+    p->path = uri - buf;
+    return true;
+}
+
+/* Parse a single byte range, "bytes=first-last", "bytes=first-" or
+ * "bytes=-suffix".  Sets of ranges are not supported.
+ */
+static bool parse_range(const char *val, long long *first, long long *last)
+{
+    if (strncasecmp(val, "bytes=", 6) || strchr(val, ','))
+        return false;
+    val += 6;
+
+    char *end;
+    *first = -1;
+    if (*val != '-') {
+        *first = strtoll(val, &end, 10);
+        if (end == val || *end != '-')
+            return false;
+        val = end;
+    }
+    val++;
+    *last = -1;
+    if (*val) {
+        *last = strtoll(val, &end, 10);
+        if (end == val || *end || *last < 0)
+            return false;
+    }
+    /* A suffix must have a length */
+    return *first >= 0 || *last >= 0;
+}
+
+/* Parse "Name: value", ending at end.  Other headers are ignored */
+static bool parse_header(http_parser_t *p, char *line, char *end)
+{
+    char *colon = memchr(line, ':', end - line);
+    if (!colon)
+        return false;
+
+    char *val = next_field(colon + 1, end);
+    if (!val)
+        return true;
+    while (end > val && (end[-1] == ' ' || end[-1] == '\t'))
+        end--;
+    *end = '\0';
+
+    size_t name_len = colon - line;
+    switch (name_len) {
+    case 5:
+        if (!strncasecmp(line, "Range", 5))
+            p->range = parse_range(val, &p->range_first, &p->range_last);
+        break;
+    case 10:
+        if (!strncasecmp(line, "Connection", 10))
+            p->close = !strcasecmp(val, "close");
+        break;
+    case 14:
+        if (!strncasecmp(line, "Content-Length", 14))
+            p->body_left = strtoul(val, NULL, 10);
+        break;
+    }
+    return true;
+}
+
+ssize_t http_parse(http_parser_t *p, char *buf, size_t len)
+{
+    while (p->pos < len) {
+        char *line = buf + p->pos;
+        char *nl = memchr(line, '\n', len - p->pos);
+        if (!nl)
+            return 0;
+        p->pos = nl + 1 - buf;
+        char *end = nl > line && nl[-1] == '\r' ? nl - 1 : nl;
+
+        if (p->state == HTTP_REQUEST_LINE) {
+            /* Empty lines ahead of a request are allowed */
+            if (end == line)
+                continue;
+            if (!parse_request_line(p, buf, line, end))
+                return -1;
+            p->state = HTTP_HEADERS;
+            continue;
+        }
+
+        if (end > line) {
+            if (!parse_header(p, line, end))
+                return -1;
+            continue;
+        }
+
+        /* The empty line ends the headers.  HTTP/1.0 responses can only be
+         * delimited by closing the connection.
+         */
+        ssize_t n = p->pos;
+        p->keep_alive = p->http11 && !p->close;
+        p->state = HTTP_REQUEST_LINE;
+        p->pos = 0;
+        return n;
+    }
+    return 0;
+}
+
+size_t http_skip_body(http_parser_t *p, size_t len)
+{
+    size_t n = p->body_left < len ? p->body_left : len;
+    p->body_left -= n;
+    return n;
+}
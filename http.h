@@ -0,0 +1,47 @@
+#ifndef LAB0_HTTP_H
+#define LAB0_HTTP_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+/* Incremental parser of HTTP requests.
+ *
+ * The parser works over the buffer the request is read into, and may be
+ * called each time more of the request arrives: lines already parsed are
+ * not scanned again.  It allocates nothing and copies nothing.  The path is
+ * decoded in place, so the buffer must be writable.
+ */
+
+typedef struct {
+    int state;
+    size_t pos;  /* Bytes of the request parsed */
+    size_t path; /* Offset of the path in the request */
+    bool http11;
+    bool close;      /* "Connection: close" */
+    bool keep_alive; /* Whether the connection stays open after the request */
+    bool range;      /* A single byte range is requested */
+    long long range_first; /* -1 for the last range_last bytes */
+    long long range_last;  /* -1 for the end of the file */
+    size_t body_left;      /* Bytes of the body not yet skipped */
+} http_parser_t;
+
+void http_parser_init(http_parser_t *p);
+
+/* Parse the request at buf, of which len bytes have arrived, picking up
+ * where the previous call stopped.
+ *
+ * Return the length of the request, up to the end of its headers, once they
+ * are complete, 0 if more bytes are needed, or -1 if the request is
+ * malformed.  Once complete, buf + p->path holds the path of the request,
+ * without its query and with '%' escapes decoded, and the parser is ready
+ * for the next request, after the body is skipped with http_skip_body().
+ */
+ssize_t http_parse(http_parser_t *p, char *buf, size_t len);
+
+/* Skip up to len bytes of the body of the last request.
+ * Return the number of bytes skipped.
+ */
+size_t http_skip_body(http_parser_t *p, size_t len);
+
+#endif /* LAB0_HTTP_H */
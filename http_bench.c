@@ -0,0 +1,363 @@
+/* Fuzzing and benchmarking of the HTTP request parser.
+ *
+ * Random requests are parsed whole, and again as they would arrive over
+ * many partial reads, and every result is checked against what was
+ * generated.  Mangled requests are then thrown at the parser, which must
+ * neither crash nor read out of bounds (build with SANITIZER=1 to check).
+ * Finally, the rate at which pipelined requests are parsed is measured.
+ */
+
+#include <getopt.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "http.h"
+#include "timing.h"
+
+#define MAX_REQUEST 8192
+
+/* Requests parsed per benchmark pass */
+#define BENCH_BATCH 1000
+
+static uint64_t rng_state = 1;
+
+static uint32_t rng(void)
+{
+    /* xorshift64* */
+    rng_state ^= rng_state >> 12;
+    rng_state ^= rng_state << 25;
+    rng_state ^= rng_state >> 27;
+    return (rng_state * 0x2545F4914F6CDD1DULL) >> 32;
+}
+
+static uint32_t rng_below(uint32_t n)
+{
+    return rng() % n;
+}
+
+/* What a generated request should parse into */
+typedef struct {
+    char path[512];
+    bool keep_alive;
+    bool range;
+    long long range_first, range_last;
+    size_t body_len;
+} expect_t;
+
+/* Print a random letter case of s */
+static size_t put_name(char *buf, const char *s)
+{
+    size_t n = 0;
+    for (; *s; s++) {
+        char c = *s;
+        if (c >= 'a' && c <= 'z' && rng_below(4) == 0)
+            c -= 'a' - 'A';
+        else if (c >= 'A' && c <= 'Z' && rng_below(4) == 0)
+            c += 'a' - 'A';
+        buf[n++] = c;
+    }
+    return n;
+}
+
+/* Random request with its body, written to buf */
+static size_t gen_request(char *buf, expect_t *e)
+{
+    static const char *methods[] = {"GET", "POST", "HEAD", "PUT"};
+    static const char hex[] = "0123456789ABCDEF";
+    const char *eol = rng_below(4) ? "\r\n" : "\n";
+    size_t n = 0, plen = 0;
+
+    memset(e, 0, sizeof(*e));
+    while (rng_below(8) == 0)
+        n += sprintf(buf + n, "%s", eol);
+
+    n += sprintf(buf + n, "%s /", methods[rng_below(4)]);
+    e->path[plen++] = '/';
+    int segs = rng_below(5);
+    for (int i = 0; i < segs; i++) {
+        if (i)
+            e->path[plen++] = buf[n++] = '/';
+        int len = 1 + rng_below(12);
+        for (int j = 0; j < len; j++) {
+            char c = 'a' + rng_below(26);
+            if (rng_below(10) == 0) {
+                /* Escaped, possibly as a space or a '/' */
+                c = " /%#abz"[rng_below(7)];
+                buf[n++] = '%';
+                buf[n++] = hex[(unsigned char) c >> 4];
+                buf[n++] = hex[c & 15];
+            } else {
+                buf[n++] = c;
+            }
+            e->path[plen++] = c;
+        }
+    }
+    e->path[plen] = '\0';
+    if (rng_below(4) == 0)
+        n += sprintf(buf + n, "?q=%u&r=%%zz", rng_below(1000));
+
+    bool http11 = rng_below(4) != 0;
+    n += sprintf(buf + n, " HTTP/1.%d%s", http11, eol);
+    e->keep_alive = http11;
+
+    int headers = rng_below(8);
+    for (int i = 0; i < headers; i++) {
+        switch (rng_below(5)) {
+        case 0:
+            n += put_name(buf + n, "Connection");
+            if (rng_below(2)) {
+                n += sprintf(buf + n, ": close%s", eol);
+                e->keep_alive = false;
+            } else {
+                n += sprintf(buf + n, ":keep-alive %s", eol);
+                e->keep_alive = http11;
+            }
+            break;
+        case 1:
+            e->body_len = rng_below(64);
+            n += put_name(buf + n, "Content-Length");
+            n += sprintf(buf + n, ":  %zu%s", e->body_len, eol);
+            break;
+        case 2:
+            n += put_name(buf + n, "Range");
+            e->range = true;
+            e->range_first = rng_below(3) ? (long long) rng_below(1000) : -1;
+            e->range_last = rng_below(2) ? (long long) rng_below(1000) : -1;
+            if (e->range_first < 0 && e->range_last < 0)
+                e->range_last = 10;
+            n += sprintf(buf + n, ": bytes=");
+            if (e->range_first >= 0)
+                n += sprintf(buf + n, "%lld", e->range_first);
+            n += sprintf(buf + n, "-");
+            if (e->range_last >= 0)
+                n += sprintf(buf + n, "%lld", e->range_last);
+            n += sprintf(buf + n, "%s", eol);
+            break;
+        default:
+            n += sprintf(buf + n, "X-Filler-%u: %u%s", rng_below(100), rng(),
+                         eol);
+            break;
+        }
+    }
+    n += sprintf(buf + n, "%s", eol);
+
+    for (size_t i = 0; i < e->body_len; i++)
+        buf[n++] = 'a' + rng_below(26);
+    return n;
+}
+
+static bool check(const http_parser_t *p,
+                  const char *buf,
+                  const expect_t *e,
+                  const char *how)
+{
+    const char *what = NULL;
+    if (strcmp(buf + p->path, e->path))
+        what = "path";
+    else if (p->keep_alive != e->keep_alive)
+        what = "keep-alive";
+    else if (p->body_left != e->body_len)
+        what = "body length";
+    else if (p->range != e->range ||
+             (e->range && (p->range_first != e->range_first ||
+                           p->range_last != e->range_last)))
+        what = "range";
+    if (what)
+        fprintf(stderr, "Wrong %s when parsed %s: '%s' instead of '%s'\n",
+                what, how, buf + p->path, e->path);
+    return !what;
+}
+
+/* Parse a generated request whole, then fed in pieces of random size */
+static bool fuzz_one(void)
+{
+    char orig[MAX_REQUEST], buf[MAX_REQUEST];
+    expect_t e;
+    size_t len = gen_request(orig, &e);
+    size_t hdr_len = len - e.body_len;
+
+    http_parser_t p;
+    http_parser_init(&p);
+    memcpy(buf, orig, len);
+    ssize_t n = http_parse(&p, buf, len);
+    if (n != (ssize_t) hdr_len) {
+        fprintf(stderr, "Parsed %zd bytes of %zu\n", n, hdr_len);
+        return false;
+    }
+    if (!check(&p, buf, &e, "whole"))
+        return false;
+    if (http_skip_body(&p, len - n) != e.body_len || p.body_left)
+        return false;
+
+    http_parser_init(&p);
+    memcpy(buf, orig, len);
+    size_t avail = 0;
+    do {
+        avail += 1 + rng_below(16);
+        if (avail > len)
+            avail = len;
+        n = http_parse(&p, buf, avail);
+    } while (n == 0 && avail < len);
+    if (n != (ssize_t) hdr_len) {
+        fprintf(stderr, "Parsed %zd bytes of %zu in pieces\n", n, hdr_len);
+        return false;
+    }
+    return check(&p, buf, &e, "in pieces");
+}
+
+/* Parse a mangled request.  Only crashes are caught */
+static void fuzz_mangled(void)
+{
+    char buf[MAX_REQUEST];
+    expect_t e;
+    size_t len = gen_request(buf, &e);
+
+    int edits = 1 + rng_below(8);
+    for (int i = 0; i < edits; i++) {
+        size_t at = rng_below(len);
+        switch (rng_below(3)) {
+        case 0:
+            buf[at] = rng();
+            break;
+        case 1:
+            buf[at] = "\r\n :%\0"[rng_below(6)];
+            break;
+        default:
+            len = at + 1;
+            break;
+        }
+    }
+
+    /* Exactly len bytes, so that reading past them is noticed */
+    char *copy = malloc(len);
+    if (!copy)
+        return;
+    memcpy(copy, buf, len);
+    http_parser_t p;
+    http_parser_init(&p);
+    size_t pos = 0;
+    while (pos < len) {
+        ssize_t n = http_parse(&p, copy + pos, len - pos);
+        if (n <= 0)
+            break;
+        pos += n;
+        pos += http_skip_body(&p, len - pos);
+    }
+    free(copy);
+}
+
+/* Parse pipelined copies of req, and print the rate */
+static void bench(const char *name, const char *req, int piece)
+{
+    size_t req_len = strlen(req);
+    size_t len = req_len * BENCH_BATCH;
+    char *orig = malloc(len), *buf = malloc(len);
+    if (!orig || !buf) {
+        free(orig);
+        free(buf);
+        return;
+    }
+    for (int i = 0; i < BENCH_BATCH; i++)
+        memcpy(orig + i * req_len, req, req_len);
+
+    /* The parser writes to the buffer, which is restored before each pass.
+     * The time of the copy is taken out.
+     */
+    int64_t copy_ns = 0, total_ns = 0;
+    long parsed = 0;
+    while (total_ns < 500000000) {
+        int64_t t0 = timing_ns();
+        memcpy(buf, orig, len);
+        int64_t t1 = timing_ns();
+
+        http_parser_t p;
+        http_parser_init(&p);
+        size_t pos = 0, avail = 0;
+        while (pos < len) {
+            avail = piece && avail + piece < len ? avail + piece : len;
+            ssize_t n = http_parse(&p, buf + pos, avail - pos);
+            /* An error, or a request that the whole batch does not end */
+            if (n < 0 || (n == 0 && avail == len))
+                break;
+            if (n > 0) {
+                pos += n;
+                parsed++;
+            }
+        }
+        int64_t t2 = timing_ns();
+        if (pos < len) {
+            fprintf(stderr, "%s: parsing stopped at byte %zu of %zu\n", name,
+                    pos, len);
+            free(orig);
+            free(buf);
+            return;
+        }
+        copy_ns += t1 - t0;
+        total_ns += t2 - t0;
+    }
+
+    double ns = (double) (total_ns - copy_ns) / parsed;
+    printf("%-24s %4zu bytes %7.1f ns/request %9.0f requests/s %7.1f MB/s\n",
+           name, req_len, ns, 1e9 / ns, req_len * 1e3 / ns);
+    free(orig);
+    free(buf);
+}
+
+static void usage(char *cmd)
+{
+    printf("Usage: %s [-h] [-s SEED] [-n FUZZ]\n", cmd);
+    printf("\t-h\t\tPrint this information\n");
+    printf("\t-s SEED\t\tSeed of the random requests\n");
+    printf("\t-n FUZZ\t\tNumber of random requests (default 100000)\n");
+}
+
+int main(int argc, char *argv[])
+{
+    size_t fuzz = 100000;
+    int c;
+    while ((c = getopt(argc, argv, "hs:n:")) != -1) {
+        switch (c) {
+        case 's':
+            rng_state = strtoull(optarg, NULL, 0) | 1;
+            break;
+        case 'n':
+            fuzz = strtoul(optarg, NULL, 0);
+            break;
+        default:
+            usage(argv[0]);
+            return c == 'h' ? 0 : 1;
+        }
+    }
+
+    timing_init();
+    for (size_t i = 0; i < fuzz; i++) {
+        if (!fuzz_one()) {
+            printf("Fuzzing failed after %zu requests\n", i);
+            return 1;
+        }
+        fuzz_mangled();
+    }
+    printf("Fuzzed %zu requests, whole, in pieces and mangled\n", fuzz);
+
+    static const char *curl =
+        "GET /it/42 HTTP/1.1\r\nHost: localhost:9999\r\n"
+        "User-Agent: curl/8.5.0\r\nAccept: */*\r\n\r\n";
+    static const char *browser =
+        "GET /queues/0/elements/100/50 HTTP/1.1\r\n"
+        "Host: localhost:9999\r\n"
+        "Connection: keep-alive\r\n"
+        "User-Agent: Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.36 "
+        "(KHTML, like Gecko) Chrome/120.0.0.0 Safari/537.36\r\n"
+        "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,"
+        "image/avif,image/webp,*/*;q=0.8\r\n"
+        "Accept-Encoding: gzip, deflate, br\r\n"
+        "Accept-Language: en-US,en;q=0.9\r\n"
+        "Range: bytes=1024-\r\n\r\n";
+    bench("curl, whole", curl, 0);
+    bench("browser, whole", browser, 0);
+    bench("browser, 64-byte reads", browser, 64);
+    bench("browser, 1-byte reads", browser, 1);
+    return 0;
+}
@@ -0,0 +1,148 @@
+/* Registry of metrics, exported in Prometheus text format or as JSON */
+
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdio.h>
+
+#include "metrics.h"
+#include "report.h"
+
+/* Maximum number of registered metrics */
+#define MAX_METRICS 64
+
+typedef struct {
+    const char *name;
+    const char *help;
+    metric_type_t type;
+    const size_t *valp;        /* Plain metric */
+    const char *label;         /* Metric family */
+    metrics_collect_t collect; /* Metric family */
+} metric_t;
+
+struct __metrics_out {
+    char *buf;
+    size_t size;
+    size_t len;
+    metrics_format_t fmt;
+    const metric_t *metric; /* Family being collected */
+    bool first;             /* No sample of the family emitted yet */
+};
+
+static metric_t metrics[MAX_METRICS];
+static int metric_cnt = 0;
+
+static metric_t *new_metric(const char *name,
+                            const char *help,
+                            metric_type_t type)
+{
+    if (metric_cnt == MAX_METRICS) {
+        report_event(MSG_WARN, "Too many metrics, dropping '%s'", name);
+        return NULL;
+    }
+
+    metric_t *m = &metrics[metric_cnt++];
+    m->name = name;
+    m->help = help;
+    m->type = type;
+    m->valp = NULL;
+    m->label = NULL;
+    m->collect = NULL;
+    return m;
+}
+
+void metrics_add(const char *name,
+                 const char *help,
+                 metric_type_t type,
+                 const size_t *valp)
+{
+    metric_t *m = new_metric(name, help, type);
+    if (m)
+        m->valp = valp;
+}
+
+void metrics_add_family(const char *name,
+                        const char *help,
+                        metric_type_t type,
+                        const char *label,
+                        metrics_collect_t collect)
+{
+    metric_t *m = new_metric(name, help, type);
+    if (m) {
+        m->label = label;
+        m->collect = collect;
+    }
+}
+
+static void out_printf(metrics_out_t *out, const char *fmt, ...)
+{
+    va_list ap;
+    va_start(ap, fmt);
+    /* Past the end of buf, only count what would have been written */
+    size_t room = out->len < out->size ? out->size - out->len : 0;
+    int n = vsnprintf(room ? out->buf + out->len : NULL, room, fmt, ap);
+    va_end(ap);
+    if (n > 0)
+        out->len += n;
+}
+
+/* Label values and JSON keys need '"' and '\' escaped */
+static void out_quoted(metrics_out_t *out, const char *s)
+{
+    out_printf(out, "\"");
+    for (; *s; s++)
+        out_printf(out, (*s == '"' || *s == '\\') ? "\\%c" : "%c", *s);
+    out_printf(out, "\"");
+}
+
+void metrics_sample(metrics_out_t *out, const char *label_value, double value)
+{
+    const metric_t *m = out->metric;
+    if (out->fmt == METRICS_PROMETHEUS) {
+        out_printf(out, "%s{%s=", m->name, m->label);
+        out_quoted(out, label_value);
+        out_printf(out, "} %.15g\n", value);
+    } else {
+        out_printf(out, out->first ? "" : ", ");
+        out_quoted(out, label_value);
+        out_printf(out, ": %.15g", value);
+    }
+    out->first = false;
+}
+
+size_t metrics_format(char *buf, size_t size, metrics_format_t fmt)
+{
+    static const char *type_name[] = {"counter", "gauge"};
+    metrics_out_t out = {.buf = buf, .size = size, .len = 0, .fmt = fmt};
+
+    if (size)
+        buf[0] = '\0';
+
+    if (fmt == METRICS_JSON)
+        out_printf(&out, "{");
+    for (int i = 0; i < metric_cnt; i++) {
+        const metric_t *m = &metrics[i];
+        out.metric = m;
+        out.first = true;
+        if (fmt == METRICS_PROMETHEUS) {
+            out_printf(&out, "# HELP %s %s\n# TYPE %s %s\n", m->name, m->help,
+                       m->name, type_name[m->type]);
+            if (m->valp)
+                out_printf(&out, "%s %zu\n", m->name, *m->valp);
+            else
+                m->collect(&out);
+        } else {
+            out_printf(&out, "%s\n  \"%s\": ", i ? "," : "", m->name);
+            if (m->valp) {
+                out_printf(&out, "%zu", *m->valp);
+            } else {
+                out_printf(&out, "{");
+                m->collect(&out);
+                out_printf(&out, "}");
+            }
+        }
+    }
+    if (fmt == METRICS_JSON)
+        out_printf(&out, "\n}\n");
+
+    return out.len;
+}
@@ -0,0 +1,40 @@
+#ifndef LAB0_METRICS_H
+#define LAB0_METRICS_H
+
+#include <stddef.h>
+
+/* Registry of metrics, exported in Prometheus text format or as JSON */
+
+typedef enum { METRIC_COUNTER, METRIC_GAUGE } metric_type_t;
+
+typedef enum { METRICS_PROMETHEUS, METRICS_JSON } metrics_format_t;
+
+/* State of an export in progress, handed to collectors */
+typedef struct __metrics_out metrics_out_t;
+
+/* Emit the samples of a metric family with metrics_sample() */
+typedef void (*metrics_collect_t)(metrics_out_t *out);
+
+/* Register a metric whose value is read from *valp at export time */
+void metrics_add(const char *name,
+                 const char *help,
+                 metric_type_t type,
+                 const size_t *valp);
+
+/* Register a family of metrics distinguished by the value of one label */
+void metrics_add_family(const char *name,
+                        const char *help,
+                        metric_type_t type,
+                        const char *label,
+                        metrics_collect_t collect);
+
+/* Emit one sample of the family being collected */
+void metrics_sample(metrics_out_t *out, const char *label_value, double value);
+
+/* Write every registered metric into buf.
+ * Return the length of the whole output, as snprintf() does.  When it is size
+ * or more, buf only holds as much of it as fits, null-terminated.
+ */
+size_t metrics_format(char *buf, size_t size, metrics_format_t fmt);
+
+#endif /* LAB0_METRICS_H */
@@ -3,6 +3,8 @@
 #include <assert.h>
 #include <errno.h>
 #include <getopt.h>
+#include <limits.h>
+#include <math.h>
 #include <signal.h>
 #include <spawn.h>
 #include <stdio.h>
@@ -44,10 +46,12 @@ extern int show_entropy;
  */
 #include "queue.h"
 
+#include "bench.h"
 #include "console.h"
-#include "dudect/cpucycles.h"
 #include "list_sort.h"
 #include "report.h"
+#include "timing.h"
+
 /* Settable parameters */
 
 #define HISTORY_LEN 20
@@ -187,6 +191,8 @@ static bool queue_insert(position_t pos, int argc, char *argv[])
             report(1, "%s does not need arguments in simulation mode", argv[0]);
             return false;
         }
+        /* dudect prints its progress directly, after what is buffered */
+        report_flush();
         bool ok =
             pos == POS_TAIL ? is_insert_tail_const() : is_insert_head_const();
         if (!ok) {
@@ -299,6 +305,8 @@ static bool queue_remove(position_t pos, int argc, char *argv[])
             report(1, "%s does not need arguments in simulation mode", argv[0]);
             return false;
         }
+        /* dudect prints its progress directly, after what is buffered */
+        report_flush();
         bool ok =
             pos == POS_TAIL ? is_remove_tail_const() : is_remove_head_const();
         if (!ok) {
@@ -606,10 +614,10 @@ bool do_sort(int argc, char *argv[])
 
     set_noallocate_mode(true);
     if (current && exception_setup(true)) {
-        before_ticks = cpucycles();
+        before_ticks = timing_cycles();
         // q_sort(current->q, descend);
         list_sort(NULL, current->q, &cmp);
-        after_ticks = cpucycles();
+        after_ticks = timing_cycles();
         report_noreturn(0, "cpucycles : %d", after_ticks - before_ticks);
         report_noreturn(0, "\n");
     }
@@ -979,6 +987,62 @@ static bool do_show(int argc, char *argv[])
     return q_show(0);
 }
 
+/* Write the elements of the current queue to a file, one per line, for
+ * offline analysis.  Web clients can then download it.
+ */
+static bool do_snapshot(int argc, char *argv[])
+{
+    if (argc != 2) {
+        report(1, "%s takes 1 argument", argv[0]);
+        return false;
+    }
+
+    if (!current || !current->q) {
+        report(3, "Warning: Try to operate null queue");
+        return false;
+    }
+
+    if (!is_circular()) {
+        report(1, "ERROR:  Queue is not doubly circular");
+        return false;
+    }
+
+    FILE *file = fopen(argv[1], "w");
+    if (!file) {
+        report(1, "Couldn't open snapshot file '%s'", argv[1]);
+        return false;
+    }
+
+    bool ok = true;
+    int cnt = 0;
+    if (exception_setup(false)) {
+        struct list_head *cur = current->q->next;
+        while (ok && cur != current->q && cnt < current->size) {
+            element_t *e = list_entry(cur, element_t, list);
+            ok = fputs(e->value, file) >= 0 && putc('\n', file) != EOF;
+            cnt++;
+            cur = cur->next;
+        }
+    } else {
+        ok = false;
+    }
+    exception_cancel();
+    ok = fclose(file) == 0 && ok;
+
+    if (!ok) {
+        report(1, "ERROR: Could not write snapshot '%s'", argv[1]);
+        return false;
+    }
+
+    /* Under snap/, so that no snapshot takes the place of the log */
+    const char *base = strrchr(argv[1], '/');
+    char name[sizeof("snap/") + NAME_MAX];
+    snprintf(name, sizeof(name), "snap/%s", base ? base + 1 : argv[1]);
+    add_download(name, argv[1]);
+    report(2, "Wrote %d elements to '%s'", cnt, argv[1]);
+    return true;
+}
+
 static bool do_prev(int argc, char *argv[])
 {
     if (argc != 1) {
@@ -1030,6 +1094,216 @@ static bool do_next(int argc, char *argv[])
 //     printf("in game");
 //     return true;
 // }
+/* Restart the failure schedule whenever one of its parameters changes */
+static void fault_changed(int oldval)
+{
+    reset_fault_injection();
+}
+
+/* The t-tests only run with several threads or in sequential mode.  Refuse
+ * those if the statistics fail their self-check.
+ */
+static void dudect_threads_changed(int oldval)
+{
+    if (dudect_threads != 1 && !dudect_check_statistics())
+        dudect_threads = oldval;
+}
+
+/* The sequential mode also relies on stopping early as it should */
+static void dudect_sequential_changed(int oldval)
+{
+    if (dudect_sequential != 0 && dudect_sequential != 1)
+        dudect_sequential = oldval;
+    else if (dudect_sequential &&
+             (!dudect_check_statistics() || !dudect_check_sequential()))
+        dudect_sequential = oldval;
+}
+
+/* Elements in all queues, as tracked by the commands */
+static size_t queue_elements()
+{
+    size_t cnt = 0;
+    queue_contex_t *ctx;
+    list_for_each_entry (ctx, &chain.head, chain)
+        cnt += ctx->size;
+    return cnt;
+}
+
+/* Read-only JSON views of the queues, served to web clients without going
+ * through the interpreter:
+ *   /queues                                  ids and sizes
+ *   /queues/<id>/elements[/<offset>[/<cnt>]]  a page of elements
+ *   /queues/<id>/summary                      extremes, lengths, entropy
+ * Each view walks the queue once and is written straight to the response.
+ */
+
+/* Largest page of elements */
+#define PAGE_MAX 10000
+
+static void json_string(web_response_t *resp, const char *s)
+{
+    if (!s) {
+        web_write(resp, "null", 4);
+        return;
+    }
+
+    web_write(resp, "\"", 1);
+    const char *run = s;
+    for (; *s; s++) {
+        unsigned char c = *s;
+        if (c >= 0x20 && c != '"' && c != '\\')
+            continue;
+        web_write(resp, run, s - run);
+        if (c == '"' || c == '\\')
+            web_printf(resp, "\\%c", c);
+        else
+            web_printf(resp, "\\u%04x", c);
+        run = s + 1;
+    }
+    web_write(resp, run, s - run);
+    web_write(resp, "\"", 1);
+}
+
+static queue_contex_t *find_queue(int id)
+{
+    queue_contex_t *ctx;
+    list_for_each_entry (ctx, &chain.head, chain) {
+        if (ctx->id == id)
+            return ctx;
+    }
+    return NULL;
+}
+
+static void json_queues(web_response_t *resp)
+{
+    web_printf(resp, "{\"current\": %d, \"queues\": [",
+               current ? current->id : -1);
+    queue_contex_t *ctx;
+    const char *sep = "";
+    list_for_each_entry (ctx, &chain.head, chain) {
+        web_printf(resp, "%s{\"id\": %d, \"size\": %d}", sep, ctx->id,
+                   ctx->size);
+        sep = ", ";
+    }
+    web_printf(resp, "]}\n");
+}
+
+/* Elements offset to offset + cnt - 1 */
+static void json_elements(web_response_t *resp,
+                          queue_contex_t *ctx,
+                          int offset,
+                          int cnt)
+{
+    web_printf(resp,
+               "{\"id\": %d, \"size\": %d, \"offset\": %d, \"elements\": [",
+               ctx->id, ctx->size, offset);
+
+    /* The queue may be broken, so never walk past its size */
+    int i = 0;
+    if (ctx->q && exception_setup(false)) {
+        struct list_head *cur = ctx->q->next;
+        while (cur && cur != ctx->q && i < ctx->size && i - offset < cnt) {
+            if (i > offset)
+                web_write(resp, ", ", 2);
+            if (i >= offset)
+                json_string(resp, list_entry(cur, element_t, list)->value);
+            i++;
+            cur = cur->next;
+        }
+    }
+    exception_cancel();
+    web_printf(resp, "]}\n");
+}
+
+static void json_summary(web_response_t *resp, queue_contex_t *ctx)
+{
+    const char *min = NULL, *max = NULL;
+    /* Lengths fall into buckets [2^(k-1), 2^k - 1], with 0 in bucket 0 */
+    size_t lengths[sizeof(size_t) * 8 + 1] = {0};
+    size_t bytes[256] = {0};
+    size_t total = 0;
+
+    int i = 0;
+    if (ctx->q && exception_setup(false)) {
+        struct list_head *cur = ctx->q->next;
+        while (cur && cur != ctx->q && i < ctx->size) {
+            const char *s = list_entry(cur, element_t, list)->value;
+            if (s) {
+                if (!min || strcmp(s, min) < 0)
+                    min = s;
+                if (!max || strcmp(s, max) > 0)
+                    max = s;
+                size_t len = 0;
+                for (; s[len]; len++)
+                    bytes[(unsigned char) s[len]]++;
+                total += len;
+                int k = 0;
+                while (len >> k)
+                    k++;
+                lengths[k]++;
+            }
+            i++;
+            cur = cur->next;
+        }
+    }
+    exception_cancel();
+
+    /* Entropy of the bytes of all elements, relative to 8 bits per byte */
+    double entropy = 0;
+    for (int c = 0; c < 256; c++) {
+        if (bytes[c]) {
+            double p = (double) bytes[c] / total;
+            entropy -= p * log2(p);
+        }
+    }
+
+    web_printf(resp, "{\"id\": %d, \"size\": %d, \"min\": ", ctx->id,
+               ctx->size);
+    json_string(resp, min);
+    web_printf(resp, ", \"max\": ");
+    json_string(resp, max);
+    web_printf(resp, ", \"lengths\": [");
+    const char *sep = "";
+    for (int k = 0; k < sizeof(lengths) / sizeof(lengths[0]); k++) {
+        if (!lengths[k])
+            continue;
+        size_t lo = k ? (size_t) 1 << (k - 1) : 0;
+        size_t hi = k ? (lo << 1) - 1 : 0;
+        web_printf(resp, "%s{\"min\": %zu, \"max\": %zu, \"count\": %zu}", sep,
+                   lo, hi, lengths[k]);
+        sep = ", ";
+    }
+    web_printf(resp, "], \"bytes\": %zu, \"entropy\": %.2f}\n", total,
+               entropy * 100 / 8);
+}
+
+static bool web_queues(char *path, web_response_t *resp)
+{
+    if (strncmp(path, "queues", 6) || (path[6] && path[6] != ' '))
+        return false;
+
+    web_set_type(resp, "application/json");
+    if (!path[6]) {
+        json_queues(resp);
+        return true;
+    }
+
+    int id, offset = 0, cnt = 100;
+    char view[16] = "";
+    int n = sscanf(path, "queues %d %15s %d %d", &id, view, &offset, &cnt);
+    queue_contex_t *ctx = n >= 2 ? find_queue(id) : NULL;
+    if (ctx && !strcmp(view, "elements") && offset >= 0 && cnt >= 0) {
+        json_elements(resp, ctx, offset, cnt < PAGE_MAX ? cnt : PAGE_MAX);
+    } else if (ctx && !strcmp(view, "summary") && n == 2) {
+        json_summary(resp, ctx);
+    } else {
+        web_set_status(resp, 404);
+        web_printf(resp, "{\"error\": \"%s\"}\n",
+                   ctx ? "Unknown view" : "No such queue");
+    }
+    return true;
+}
+
 static void console_init()
 {
     ADD_COMMAND(new, "Create new queue", "");
@@ -1056,6 +1330,8 @@ static void console_init()
     ADD_COMMAND(sort, "Sort queue in ascending/descening order", "");
     ADD_COMMAND(size, "Compute queue size n times (default: n == 1)", "[n]");
     ADD_COMMAND(show, "Show queue contents", "");
+    ADD_COMMAND(snapshot, "Write queue contents to file, one per line",
+                "file");
     ADD_COMMAND(dm, "Delete middle node in queue", "");
     ADD_COMMAND(dedup, "Delete all nodes that have duplicate string", "");
     ADD_COMMAND(merge, "Merge all the queues into one sorted queue", "");
@@ -1074,15 +1350,38 @@ static void console_init()
     add_param("length", &string_length, "Maximum length of displayed string",
               NULL);
     add_param("malloc", &fail_probability, "Malloc failure probability percent",
+              fault_changed);
+    add_param("malloc_seed", &fail_seed,
+              "Seed of malloc failures (0: different on every run)",
+              fault_changed);
+    add_param("malloc_nth", &fail_nth, "Fail the Nth malloc (0: disabled)",
+              fault_changed);
+    add_param("malloc_every", &fail_every,
+              "Fail every Kth malloc (0: disabled)", fault_changed);
+    add_param("timelimit_us", &time_limit_us,
+              "Time budget per operation in microseconds (0: 1 second)",
               NULL);
+    add_param("poison", &poison_interval,
+              "Poison every Nth malloc'd/freed block (0: never)", NULL);
     add_param("fail", &fail_limit,
               "Number of times allow queue operations to return false", NULL);
     add_param("descend", &descend,
               "Sort and merge queue in ascending/descending order", NULL);
+    add_param("dudect_threads", &dudect_threads,
+              "Threads measuring in simulation mode (0: one per CPU)",
+              dudect_threads_changed);
+    add_param("dudect_sequential", &dudect_sequential,
+              "Stop measuring in simulation mode once conclusive",
+              dudect_sequential_changed);
+    harness_add_metrics();
+    set_element_count(queue_elements);
+    add_web_route(web_queues);
 }
 /* Signal handlers */
 static void sigsegv_handler(int sig)
 {
+    /* Show what the command reported before it crashed */
+    report_flush_signal();
     /* Avoid possible non-reentrant signal function be used in signal handler */
     assert(write(1,
                  "Segmentation fault occurred.  You dereferenced a NULL or "
@@ -1139,8 +1438,9 @@ static bool q_quit(int argc, char *argv[])
 
 static void usage(char *cmd)
 {
-    printf("Usage: %s [-h] [-f IFILE][-v VLEVEL][-l LFILE]\n", cmd);
+    printf("Usage: %s [-h] [-b] [-f IFILE][-v VLEVEL][-l LFILE]\n", cmd);
     printf("\t-h         Print this information\n");
+    printf("\t-b         Benchmark every queue operation and exit\n");
     printf("\t-f IFILE   Read commands from IFILE\n");
     printf("\t-v VLEVEL  Set verbosity level\n");
     printf("\t-l LFILE   Echo results to LFILE\n");
@@ -1212,13 +1512,17 @@ int main(int argc, char *argv[])
     char lbuf[BUFSIZE];
     char *logfile_name = NULL;
     int level = 4;
+    bool bench = false;
     int c;
 
-    while ((c = getopt(argc, argv, "hv:f:l:")) != -1) {
+    while ((c = getopt(argc, argv, "hbv:f:l:")) != -1) {
         switch (c) {
         case 'h':
             usage(argv[0]);
             break;
+        case 'b':
+            bench = true;
+            break;
         case 'f':
             strncpy(buf, optarg, BUFSIZE);
             buf[BUFSIZE - 1] = '\0';
@@ -1251,7 +1555,11 @@ int main(int argc, char *argv[])
      */
     srand(os_random(getpid() ^ getppid()));
 
+    timing_init();
     q_init();
+    if (bench)
+        return !bench_run();
+
     init_cmd();
     console_init();
 
@@ -1,30 +1,63 @@
+/* dladdr() is a GNU extension in glibc */
+#if defined(__linux__)
+#define _GNU_SOURCE
+#endif
+
+#include <dlfcn.h>
+#include <errno.h>
+#include <pthread.h>
 #include <signal.h>
+#include <stdatomic.h>
 #include <stdarg.h>
+#include <stdint.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/resource.h>
-#include <sys/time.h>
+#include <sys/uio.h>
 #include <time.h>
 #include <unistd.h>
 
+#include "metrics.h"
 #include "report.h"
-#include "web.h"
+#include "timing.h"
 
 #define MAX(a, b) ((a) < (b) ? (b) : (a))
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
 
-static FILE *errfile = NULL;
 static FILE *verbfile = NULL;
 static FILE *logfile = NULL;
 
 int verblevel = 0;
-static void init_files(FILE *efile, FILE *vfile)
+
+static void report_atexit();
+static void init_files(FILE *vfile)
 {
-    errfile = efile;
+    static bool exit_registered = false;
     verbfile = vfile;
+    /* Do not lose pending output on any path through exit() */
+    if (!exit_registered)
+        atexit(report_atexit);
+    exit_registered = true;
 }
 
+/* Output is formatted once into the blocks of out_buf, then written to
+ * stdout, the log file and the web client when a command completes (see
+ * report_flush), or earlier should every block fill up.  The blocks go to
+ * stdout with a single writev().
+ */
+#define OUT_BLOCKSIZE (64 * 1024)
+#define OUT_BLOCKS 16
+static char out_buf[OUT_BLOCKS][OUT_BLOCKSIZE];
+static size_t out_len[OUT_BLOCKS];
+/* Block being filled.  Those before it are full. */
+static int out_blk = 0;
+
+/* Extra destination of the output, such as a web client */
+static report_sink_t out_sink = NULL;
+static void *out_sink_arg = NULL;
+
 static char fail_buf[1024] = "FATAL Error.  Exiting\n";
 
 static volatile int ret = 0;
@@ -45,10 +78,310 @@ void set_verblevel(int level)
     verblevel = level;
 }
 
+static void write_all(int fd, const char *buf, size_t len)
+{
+    while (len > 0) {
+        ssize_t n = write(fd, buf, len);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return;
+        }
+        buf += n;
+        len -= n;
+    }
+}
+
+/* Like write_all, over cnt buffers.  iov is consumed. */
+static void writev_all(int fd, struct iovec *iov, int cnt)
+{
+    while (cnt > 0) {
+        ssize_t n = writev(fd, iov, cnt);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return;
+        }
+        while (cnt > 0 && (size_t) n >= iov->iov_len) {
+            n -= iov->iov_len;
+            iov++;
+            cnt--;
+        }
+        if (cnt > 0) {
+            iov->iov_base = (char *) iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+}
+
+/* Asynchronous logging.
+ * report_flush() copies log output into a single-producer single-consumer
+ * ring, and a background thread drains the ring into the log file with large
+ * writes.  The command loop only waits when the ring is full, or in
+ * report_barrier().  It is off unless enabled with 'option asynclog 1'.
+ */
+int log_async = 0;
+
+/* Must be a power of 2 */
+#define LOG_RING_SIZE (1 << 20)
+
+static char log_ring[LOG_RING_SIZE];
+/* Free-running byte counters, advanced by the command loop and the logging
+ * thread respectively.  Their difference is the amount of pending data.
+ */
+static atomic_size_t log_head = 0;
+static atomic_size_t log_tail = 0;
+static atomic_bool log_stop = false;
+static pthread_t log_thread;
+static bool log_running = false;
+static int log_fd = -1;
+
+/* Either side blocks on a condition variable rather than polling: the logging
+ * thread on log_filled while the ring is empty, the command loop on
+ * log_drained while the ring is full or being waited for.  A side announces
+ * that it is about to block with its flag, and the other side only takes
+ * log_lock to signal it when the flag is set.  Flags and counters are
+ * sequentially consistent, so either the blocking side sees the new counter,
+ * or the other side sees the flag.
+ */
+static pthread_mutex_t log_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t log_filled = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t log_drained = PTHREAD_COND_INITIALIZER;
+static atomic_bool log_idle = false;
+static atomic_bool log_waiting = false;
+
+/* Wake the logging thread up, if it waits for data */
+static void log_wake_writer()
+{
+    if (!atomic_load(&log_idle))
+        return;
+    pthread_mutex_lock(&log_lock);
+    pthread_cond_signal(&log_filled);
+    pthread_mutex_unlock(&log_lock);
+}
+
+/* Wait until the logging thread has moved the tail past tail */
+static void log_wait_drained(size_t tail)
+{
+    pthread_mutex_lock(&log_lock);
+    atomic_store(&log_waiting, true);
+    while (atomic_load(&log_tail) == tail)
+        pthread_cond_wait(&log_drained, &log_lock);
+    atomic_store(&log_waiting, false);
+    pthread_mutex_unlock(&log_lock);
+}
+
+static void *log_writer(void *arg)
+{
+    for (;;) {
+        size_t tail = atomic_load_explicit(&log_tail, memory_order_relaxed);
+        size_t head = atomic_load(&log_head);
+        if (head == tail) {
+            if (atomic_load(&log_stop))
+                break;
+            pthread_mutex_lock(&log_lock);
+            atomic_store(&log_idle, true);
+            while (atomic_load(&log_head) == tail && !atomic_load(&log_stop))
+                pthread_cond_wait(&log_filled, &log_lock);
+            atomic_store(&log_idle, false);
+            pthread_mutex_unlock(&log_lock);
+            continue;
+        }
+
+        /* Write everything up to the end of the ring in one go */
+        size_t off = tail & (LOG_RING_SIZE - 1);
+        size_t len = MIN(head - tail, LOG_RING_SIZE - off);
+        write_all(log_fd, log_ring + off, len);
+        atomic_store(&log_tail, tail + len);
+        if (atomic_load(&log_waiting)) {
+            pthread_mutex_lock(&log_lock);
+            pthread_cond_signal(&log_drained);
+            pthread_mutex_unlock(&log_lock);
+        }
+    }
+    return NULL;
+}
+
+static bool log_start()
+{
+    /* Signals such as SIGALRM belong to the command loop */
+    sigset_t all, old;
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+
+    fflush(logfile);
+    log_fd = fileno(logfile);
+    atomic_store(&log_stop, false);
+    log_running = pthread_create(&log_thread, NULL, log_writer, NULL) == 0;
+
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    return log_running;
+}
+
+/* Wait until the logging thread has written everything, then stop it */
+static void log_stop_thread()
+{
+    if (!log_running)
+        return;
+    pthread_mutex_lock(&log_lock);
+    atomic_store(&log_stop, true);
+    pthread_cond_signal(&log_filled);
+    pthread_mutex_unlock(&log_lock);
+    pthread_join(log_thread, NULL);
+    log_running = false;
+}
+
+static void log_push(const char *buf, size_t len)
+{
+    while (len > 0) {
+        size_t head = atomic_load_explicit(&log_head, memory_order_relaxed);
+        size_t tail = atomic_load_explicit(&log_tail, memory_order_acquire);
+        size_t room = LOG_RING_SIZE - (head - tail);
+        if (!room) {
+            log_wait_drained(tail);
+            continue;
+        }
+
+        size_t off = head & (LOG_RING_SIZE - 1);
+        size_t n = MIN(MIN(len, room), LOG_RING_SIZE - off);
+        memcpy(log_ring + off, buf, n);
+        atomic_store(&log_head, head + n);
+        log_wake_writer();
+        buf += n;
+        len -= n;
+    }
+}
+
+static void log_write(const char *buf, size_t len)
+{
+    if (log_async && (log_running || log_start())) {
+        log_push(buf, len);
+        return;
+    }
+
+    /* Synchronous mode, or the thread could not be started */
+    log_stop_thread();
+    fwrite(buf, 1, len, logfile);
+    fflush(logfile);
+}
+
+void report_barrier()
+{
+    report_flush();
+    while (log_running) {
+        /* Read the tail first, so that pending data is past it */
+        size_t tail = atomic_load(&log_tail);
+        if (tail == atomic_load(&log_head))
+            break;
+        log_wait_drained(tail);
+    }
+}
+
+static void report_atexit()
+{
+    report_flush();
+    log_stop_thread();
+}
+
 bool set_logfile(const char *file_name)
 {
+    report_flush();
+    if (logfile) {
+        log_stop_thread();
+        fclose(logfile);
+    }
     logfile = fopen(file_name, "w");
-    return logfile != NULL;
+    if (!logfile)
+        return false;
+    if (!verbfile)
+        init_files(stdout);
+    return true;
+}
+
+void report_set_sink(report_sink_t sink, void *arg)
+{
+    report_flush();
+    out_sink = sink;
+    out_sink_arg = arg;
+}
+
+void report_flush()
+{
+    if (!out_blk && !out_len[0])
+        return;
+
+    if (!verbfile)
+        init_files(stdout);
+    /* Keep ordering with anything printed through stdio */
+    fflush(verbfile);
+    struct iovec iov[OUT_BLOCKS];
+    for (int i = 0; i <= out_blk; i++) {
+        iov[i].iov_base = out_buf[i];
+        iov[i].iov_len = out_len[i];
+    }
+    writev_all(fileno(verbfile), iov, out_blk + 1);
+
+    for (int i = 0; i <= out_blk; i++) {
+        if (logfile)
+            log_write(out_buf[i], out_len[i]);
+        if (out_sink)
+            out_sink(out_buf[i], out_len[i], out_sink_arg);
+        out_len[i] = 0;
+    }
+    out_blk = 0;
+}
+
+void report_flush_signal()
+{
+    for (int i = 0; i <= out_blk; i++)
+        write_all(STDOUT_FILENO, out_buf[i], out_len[i]);
+}
+
+/* Move on to the next block, or flush them all when there is none */
+static void out_next_block()
+{
+    if (out_blk == OUT_BLOCKS - 1)
+        report_flush();
+    else
+        out_blk++;
+}
+
+/* Append formatted text to the output buffer */
+static void out_vprintf(const char *fmt, va_list ap)
+{
+    va_list aq;
+    va_copy(aq, ap);
+    size_t room = OUT_BLOCKSIZE - out_len[out_blk];
+    int n = vsnprintf(out_buf[out_blk] + out_len[out_blk], room, fmt, aq);
+    va_end(aq);
+    if (n < 0)
+        return;
+
+    if ((size_t) n >= room) {
+        out_next_block();
+        n = vsnprintf(out_buf[out_blk], OUT_BLOCKSIZE, fmt, ap);
+        if (n < 0)
+            return;
+        /* Truncate messages longer than a whole block */
+        if (n >= OUT_BLOCKSIZE)
+            n = OUT_BLOCKSIZE - 1;
+    }
+    out_len[out_blk] += n;
+}
+
+static void out_printf(const char *fmt, ...)
+{
+    va_list ap;
+    va_start(ap, fmt);
+    out_vprintf(fmt, ap);
+    va_end(ap);
+}
+
+static void out_putc(char c)
+{
+    if (out_len[out_blk] == OUT_BLOCKSIZE)
+        out_next_block();
+    out_buf[out_blk][out_len[out_blk]++] = c;
 }
 
 void report_event(message_t msg, char *fmt, ...)
@@ -68,94 +401,45 @@ void report_event(message_t msg, char *fmt, ...)
     if (verblevel < level)
         return;
 
-    if (!errfile)
-        init_files(stdout, stdout);
-
+    out_printf("%s: ", msg_name);
     va_start(ap, fmt);
-    fprintf(errfile, "%s: ", msg_name);
-    vfprintf(errfile, fmt, ap);
-    fprintf(errfile, "\n");
-    fflush(errfile);
+    out_vprintf(fmt, ap);
     va_end(ap);
-
-    if (logfile) {
-        va_start(ap, fmt);
-        fprintf(logfile, "Error: ");
-        vfprintf(logfile, fmt, ap);
-        fprintf(logfile, "\n");
-        fflush(logfile);
-        va_end(ap);
-        fclose(logfile);
-    }
+    out_putc('\n');
+    /* Events go out right away, along with what led up to them */
+    report_flush();
 
     if (fatal) {
+        log_stop_thread();
         if (fatal_fun)
             fatal_fun();
+        if (logfile)
+            fclose(logfile);
         exit(1);
     }
 }
 
-#define BUF_SIZE 4096
-extern int web_connfd;
 void report(int level, char *fmt, ...)
 {
-    if (!verbfile)
-        init_files(stdout, stdout);
-
-    char buffer[BUF_SIZE];
-    if (level <= verblevel) {
-        va_list ap;
-        va_start(ap, fmt);
-        vfprintf(verbfile, fmt, ap);
-        fprintf(verbfile, "\n");
-        fflush(verbfile);
-        va_end(ap);
-
-        if (logfile) {
-            va_start(ap, fmt);
-            vfprintf(logfile, fmt, ap);
-            fprintf(logfile, "\n");
-            fflush(logfile);
-            va_end(ap);
-        }
-        va_start(ap, fmt);
-        vsnprintf(buffer, BUF_SIZE, fmt, ap);
-        va_end(ap);
-    }
-    if (web_connfd) {
-        int len = strlen(buffer);
-        buffer[len] = '\n';
-        buffer[len + 1] = '\0';
-        web_send(web_connfd, buffer);
-    }
+    if (level > verblevel)
+        return;
+
+    va_list ap;
+    va_start(ap, fmt);
+    out_vprintf(fmt, ap);
+    va_end(ap);
+    out_putc('\n');
 }
 
 void report_noreturn(int level, char *fmt, ...)
 {
-    if (!verbfile)
-        init_files(stdout, stdout);
-
-    char buffer[BUF_SIZE];
-    if (level <= verblevel) {
-        va_list ap;
-        va_start(ap, fmt);
-        vfprintf(verbfile, fmt, ap);
-        fflush(verbfile);
-        va_end(ap);
-
-        if (logfile) {
-            va_start(ap, fmt);
-            vfprintf(logfile, fmt, ap);
-            fflush(logfile);
-            va_end(ap);
-        }
-        va_start(ap, fmt);
-        vsnprintf(buffer, BUF_SIZE, fmt, ap);
-        va_end(ap);
-    }
+    if (level > verblevel)
+        return;
 
-    if (web_connfd)
-        web_send(web_connfd, buffer);
+    va_list ap;
+    va_start(ap, fmt);
+    out_vprintf(fmt, ap);
+    va_end(ap);
 }
 
 /* Functions denoting failures */
@@ -163,6 +447,8 @@ void report_noreturn(int level, char *fmt, ...)
 /* Need to be able to print without using malloc */
 static void fail_fun(const char *format, const char *msg)
 {
+    report_flush();
+    log_stop_thread();
     snprintf(fail_buf, sizeof(fail_buf), format, msg);
     /* Tack on return */
     fail_buf[strlen(fail_buf)] = '\n';
@@ -192,11 +478,16 @@ static size_t allocate_bytes = 0;
 static size_t free_cnt = 0;
 static size_t free_bytes = 0;
 
-/* Counters giving peak memory usage */
+/* Counters giving peak memory usage, overall and since reset_last_peak() */
 static size_t peak_bytes = 0;
 static size_t last_peak_bytes = 0;
 static size_t current_bytes = 0;
 
+void reset_last_peak()
+{
+    last_peak_bytes = current_bytes;
+}
+
 static void check_exceed(size_t new_bytes)
 {
     size_t limit_bytes = (size_t) mblimit << 20;
@@ -208,15 +499,152 @@ static void check_exceed(size_t new_bytes)
     }
 }
 
-/* Call malloc & exit if fails */
-void *malloc_or_fail(size_t bytes, const char *fun_name)
+/* Heap profiling by allocation site.
+ * Sites are either the return address of the caller of test_malloc, or the
+ * function name handed to one of the *_or_fail functions below.
+ */
+typedef struct {
+    const void *site;
+    const char *name;
+    size_t alloc_cnt;  /* Allocations made from this site */
+    size_t live_cnt;   /* Blocks from this site not freed yet */
+    size_t live_bytes; /* Bytes held by those blocks */
+    size_t peak_bytes; /* Maximum of live_bytes */
+} heap_site_t;
+
+/* Must be a power of 2 */
+#define HEAP_SITES 512
+
+static heap_site_t heap_sites[HEAP_SITES];
+static size_t heap_site_cnt = 0;
+
+/* Catch-all entry once the table is three quarters full */
+static heap_site_t heap_site_other = {.name = "(other sites)"};
+
+static size_t heap_site_hash(const void *site, const char *name)
 {
-    check_exceed(bytes);
-    void *p = malloc(bytes);
-    if (!p) {
-        fail_fun("Malloc returned NULL in %s", fun_name);
-        return NULL;
+    size_t h = (size_t) 0xcbf29ce484222325ULL;
+    if (name) {
+        /* Identical labels may live at different addresses */
+        while (*name)
+            h = (h ^ (unsigned char) *name++) * (size_t) 0x100000001b3ULL;
+        return h;
+    }
+    return ((uintptr_t) site >> 2) * (size_t) 0x9e3779b97f4a7c15ULL;
+}
+
+static bool heap_site_match(const heap_site_t *hs,
+                            const void *site,
+                            const char *name)
+{
+    if (name)
+        return hs->name && strcmp(hs->name, name) == 0;
+    return !hs->name && hs->site == site;
+}
+
+static heap_site_t *heap_site_find(const void *site, const char *name)
+{
+    size_t i = heap_site_hash(site, name) & (HEAP_SITES - 1);
+    while (heap_sites[i].alloc_cnt) {
+        if (heap_site_match(&heap_sites[i], site, name))
+            return &heap_sites[i];
+        i = (i + 1) & (HEAP_SITES - 1);
+    }
+
+    if (heap_site_cnt >= HEAP_SITES / 4 * 3)
+        return &heap_site_other;
+    heap_site_cnt++;
+    heap_sites[i].site = site;
+    heap_sites[i].name = name;
+    return &heap_sites[i];
+}
+
+void heap_site_alloc(const void *site, const char *name, size_t bytes)
+{
+    heap_site_t *hs = heap_site_find(site, name);
+    hs->alloc_cnt++;
+    hs->live_cnt++;
+    hs->live_bytes += bytes;
+    hs->peak_bytes = MAX(hs->peak_bytes, hs->live_bytes);
+}
+
+void heap_site_free(const void *site, const char *name, size_t bytes)
+{
+    heap_site_t *hs = heap_site_find(site, name);
+    hs->live_cnt--;
+    hs->live_bytes -= bytes;
+}
+
+static int heap_site_cmp(const void *a, const void *b)
+{
+    const heap_site_t *x = *(const heap_site_t **) a;
+    const heap_site_t *y = *(const heap_site_t **) b;
+    if (x->live_bytes != y->live_bytes)
+        return x->live_bytes < y->live_bytes ? 1 : -1;
+    if (x->peak_bytes != y->peak_bytes)
+        return x->peak_bytes < y->peak_bytes ? 1 : -1;
+    return 0;
+}
+
+/* Describe where a site is, falling back to an offset within the binary
+ * that can be resolved with addr2line(1).
+ */
+static void heap_site_describe(const heap_site_t *hs, char *buf, size_t size)
+{
+    Dl_info info;
+    if (hs->name) {
+        snprintf(buf, size, "%s", hs->name);
+    } else if (dladdr(hs->site, &info) && info.dli_sname) {
+        snprintf(buf, size, "%s+%#lx", info.dli_sname,
+                 (unsigned long) ((uintptr_t) hs->site -
+                                  (uintptr_t) info.dli_saddr));
+    } else if (dladdr(hs->site, &info) && info.dli_fname) {
+        const char *base = strrchr(info.dli_fname, '/');
+        snprintf(buf, size, "%s+%#lx", base ? base + 1 : info.dli_fname,
+                 (unsigned long) ((uintptr_t) hs->site -
+                                  (uintptr_t) info.dli_fbase));
+    } else {
+        snprintf(buf, size, "%p", hs->site);
+    }
+}
+
+void heap_site_report(int level)
+{
+    heap_site_t *sorted[HEAP_SITES + 1];
+    size_t cnt = 0;
+    for (size_t i = 0; i < HEAP_SITES; i++) {
+        if (heap_sites[i].alloc_cnt)
+            sorted[cnt++] = &heap_sites[i];
     }
+    if (heap_site_other.alloc_cnt)
+        sorted[cnt++] = &heap_site_other;
+    qsort(sorted, cnt, sizeof(heap_site_t *), heap_site_cmp);
+
+    report(level, "%12s %10s %10s %12s  %s", "live bytes", "live blks",
+           "allocs", "peak bytes", "site");
+    for (size_t i = 0; i < cnt; i++) {
+        char where[128];
+        heap_site_describe(sorted[i], where, sizeof(where));
+        report(level, "%12lu %10lu %10lu %12lu  %s", sorted[i]->live_bytes,
+               sorted[i]->live_cnt, sorted[i]->alloc_cnt,
+               sorted[i]->peak_bytes, where);
+    }
+}
+
+/* Every block handed out by the *_or_fail functions starts with a tag naming
+ * the function that asked for it, so the block can be attributed to the same
+ * site when freed.  Padded to keep the payload aligned like malloc's.
+ */
+typedef struct {
+    const char *fun_name;
+    size_t bytes;
+} __attribute__((aligned(16))) block_tag_t;
+
+static void *tag_block(block_tag_t *tag, size_t bytes, const char *fun_name)
+{
+    tag->fun_name = fun_name;
+    tag->bytes = bytes;
+    heap_site_alloc(NULL, fun_name, bytes);
 
     allocate_cnt++;
     allocate_bytes += bytes;
@@ -224,26 +652,33 @@ void *malloc_or_fail(size_t bytes, const char *fun_name)
     peak_bytes = MAX(peak_bytes, current_bytes);
     last_peak_bytes = MAX(last_peak_bytes, current_bytes);
 
-    return p;
+    return tag + 1;
+}
+
+/* Call malloc & exit if fails */
+void *malloc_or_fail(size_t bytes, const char *fun_name)
+{
+    check_exceed(bytes);
+    block_tag_t *tag = malloc(sizeof(block_tag_t) + bytes);
+    if (!tag) {
+        fail_fun("Malloc returned NULL in %s", fun_name);
+        return NULL;
+    }
+
+    return tag_block(tag, bytes, fun_name);
 }
 
 /* Call calloc returns NULL & exit if fails */
 void *calloc_or_fail(size_t cnt, size_t bytes, const char *fun_name)
 {
     check_exceed(cnt * bytes);
-    void *p = calloc(cnt, bytes);
-    if (!p) {
+    block_tag_t *tag = calloc(1, sizeof(block_tag_t) + cnt * bytes);
+    if (!tag) {
         fail_fun("Calloc returned NULL in %s", fun_name);
         return NULL;
     }
 
-    allocate_cnt++;
-    allocate_bytes += cnt * bytes;
-    current_bytes += cnt * bytes;
-    peak_bytes = MAX(peak_bytes, current_bytes);
-    last_peak_bytes = MAX(last_peak_bytes, current_bytes);
-
-    return p;
+    return tag_block(tag, cnt * bytes, fun_name);
 }
 
 char *strsave_or_fail(const char *s, const char *fun_name)
@@ -253,25 +688,30 @@ char *strsave_or_fail(const char *s, const char *fun_name)
 
     size_t len = strlen(s);
     check_exceed(len + 1);
-    char *ss = malloc(len + 1);
-    if (!ss)
+    block_tag_t *tag = malloc(sizeof(block_tag_t) + len + 1);
+    if (!tag)
         fail_fun("strsave failed in %s", fun_name);
 
-    allocate_cnt++;
-    allocate_bytes += len + 1;
-    current_bytes += len + 1;
-    peak_bytes = MAX(peak_bytes, current_bytes);
-    last_peak_bytes = MAX(last_peak_bytes, current_bytes);
-
+    char *ss = tag_block(tag, len + 1, fun_name);
     return strncpy(ss, s, len + 1);
 }
 
+/* Release a block from one of the *_or_fail functions */
+static void untag_block(void *b)
+{
+    block_tag_t *tag = (block_tag_t *) b - 1;
+    heap_site_free(NULL, tag->fun_name, tag->bytes);
+    free(tag);
+}
+
 /* Free block, as from malloc, realloc, or strsave */
 void free_block(void *b, size_t bytes)
 {
-    if (!b)
+    if (!b) {
         report_event(MSG_ERROR, "Attempting to free null block");
-    free(b);
+        return;
+    }
+    untag_block(b);
 
     free_cnt++;
     free_bytes += bytes;
@@ -281,9 +721,11 @@ void free_block(void *b, size_t bytes)
 /* Free array, as from calloc */
 void free_array(void *b, size_t cnt, size_t bytes)
 {
-    if (!b)
+    if (!b) {
         report_event(MSG_ERROR, "Attempting to free null block");
-    free(b);
+        return;
+    }
+    untag_block(b);
 
     free_cnt++;
     free_bytes += cnt * bytes;
@@ -293,11 +735,33 @@ void free_array(void *b, size_t cnt, size_t bytes)
 /* Free string saved by strsave_or_fail */
 void free_string(char *s)
 {
-    if (!s)
+    if (!s) {
         report_event(MSG_ERROR, "Attempting to free null block");
+        return;
+    }
     free_block((void *) s, strlen(s) + 1);
 }
 
+void report_add_metrics()
+{
+    metrics_add("qtest_heap_allocs_total",
+                "Blocks allocated through malloc_or_fail and friends",
+                METRIC_COUNTER, &allocate_cnt);
+    metrics_add("qtest_heap_alloc_bytes_total", "Bytes allocated",
+                METRIC_COUNTER, &allocate_bytes);
+    metrics_add("qtest_heap_frees_total", "Blocks freed", METRIC_COUNTER,
+                &free_cnt);
+    metrics_add("qtest_heap_free_bytes_total", "Bytes freed", METRIC_COUNTER,
+                &free_bytes);
+    metrics_add("qtest_heap_live_bytes", "Bytes currently allocated",
+                METRIC_GAUGE, &current_bytes);
+    metrics_add("qtest_heap_peak_bytes", "Maximum of bytes allocated",
+                METRIC_GAUGE, &peak_bytes);
+    metrics_add("qtest_heap_last_peak_bytes",
+                "Maximum of bytes allocated during the latest command",
+                METRIC_GAUGE, &last_peak_bytes);
+}
+
 /* Initialization of timers */
 void init_time(double *timep)
 {
@@ -306,9 +770,7 @@ void init_time(double *timep)
 
 double delta_time(double *timep)
 {
-    struct timeval tv;
-    gettimeofday(&tv, NULL);
-    double current_time = tv.tv_sec + 1.0E-6 * tv.tv_usec;
+    double current_time = 1.0E-9 * timing_ns();
     double delta = current_time - *timep;
     *timep = current_time;
     return delta;
@@ -3,6 +3,7 @@
 
 #include <stdarg.h>
 #include <stdbool.h>
+#include <stddef.h>
 
 /* Ways to report interesting behavior and errors */
 
@@ -14,6 +15,9 @@ typedef enum { MSG_WARN, MSG_ERROR, MSG_FATAL, N_MSG } message_t;
 
 bool set_logfile(const char *file_name);
 
+/* Write the log file from a background thread (default 0: synchronously) */
+extern int log_async;
+
 extern int verblevel;
 void set_verblevel(int level);
 
@@ -26,6 +30,26 @@ void report(int verblevel, char *fmt, ...);
 /* Like report, but without return character */
 void report_noreturn(int verblevel, char *fmt, ...);
 
+/* Write out everything reported so far.
+ * Output is buffered and written to every destination at once, which happens
+ * after each command and whenever the buffer fills up.
+ */
+void report_flush();
+
+/* Write out to stdout what report_flush would, with write(2) alone, so that
+ * signal handlers may call it.  The log file and the sink are left out.
+ */
+void report_flush_signal();
+
+/* Like report_flush, but also wait until the log file has caught up */
+void report_barrier();
+
+/* Also pass all output to sink, which replaces any previous one.
+ * Output reported so far is flushed first.  NULL removes the sink.
+ */
+typedef void (*report_sink_t)(const char *buf, size_t len, void *arg);
+void report_set_sink(report_sink_t sink, void *arg);
+
 /* Attempt to call malloc.  Fail when returns NULL */
 void *malloc_or_fail(size_t bytes, const char *fun_name);
 
@@ -44,6 +68,25 @@ void free_array(void *b, size_t cnt, size_t bytes);
 /* Free string saved by strsave_or_fail */
 void free_string(char *s);
 
+/* Account for a block allocated at a call site.  Sites are identified by
+ * name when one is given, and by code address otherwise.
+ */
+void heap_site_alloc(const void *site, const char *name, size_t bytes);
+
+/* Account for a block from a call site being freed */
+void heap_site_free(const void *site, const char *name, size_t bytes);
+
+/* Report live bytes, live blocks, allocation count and peak bytes for every
+ * allocation site, largest live bytes first.
+ */
+void heap_site_report(int level);
+
+/* Start tracking the peak of bytes allocated over again, as from now */
+void reset_last_peak();
+
+/* Register the allocation counters with the metrics registry */
+void report_add_metrics();
+
 /* Time counted as fp number in seconds */
 void init_time(double *timep);
 
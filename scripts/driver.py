@@ -35,7 +35,13 @@ class Tracer:
         14: "trace-14-perf",
         15: "trace-15-perf",
         16: "trace-16-perf",
-        17: "trace-17-complexity"
+        17: "trace-17-complexity",
+        18: "trace-18-fault",
+        19: "trace-19-poison",
+        20: "trace-20-timelimit",
+        21: "trace-21-compiled",
+        22: "trace-22-loop",
+        23: "trace-23-dudect"
     }
 
     traceProbs = {
@@ -55,10 +61,18 @@ class Tracer:
         14: "Trace-14",
         15: "Trace-15",
         16: "Trace-16",
-        17: "Trace-17"
+        17: "Trace-17",
+        18: "Trace-18",
+        19: "Trace-19",
+        20: "Trace-20",
+        21: "Trace-21",
+        22: "Trace-22",
+        23: "Trace-23"
     }
 
-    maxScores = [0, 5, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 5]
+    # Traces from 18 on check qtest itself.  They are worth no points, but
+    # the run fails if any of them does.
+    maxScores = [0, 5, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 5, 0, 0, 0, 0, 0, 0]
 
     RED = '\033[91m'
     GREEN = '\033[92m'
@@ -109,6 +123,7 @@ class Tracer:
             tidList = [tid]
         score = 0
         maxscore = 0
+        failed = False
         if self.useValgrind:
             self.command = ['valgrind', self.qtest]
         else:
@@ -120,14 +135,15 @@ class Tracer:
             ok = self.runTrace(t)
             maxval = self.maxScores[t]
             tval = maxval if ok else 0
-            if tval < maxval:
+            failed = failed or not ok
+            if not ok:
                 self.printInColor("---\t%s\t%d/%d" % (tname, tval, maxval), self.RED)
             else:
                 self.printInColor("---\t%s\t%d/%d" % (tname, tval, maxval), self.GREEN)
             score += tval
             maxscore += maxval
             scoreDict[t] = tval
-        if score < maxscore:
+        if failed:
             self.printInColor("---\tTOTAL\t\t%d/%d" % (score, maxscore), self.RED)
         else:
             self.printInColor("---\tTOTAL\t\t%d/%d" % (score, maxscore), self.GREEN)
@@ -142,7 +158,7 @@ class Tracer:
                 jstring += '"%s" : %d' % (self.traceProbs[k], scoreDict[k])
             jstring += '}}'
             print(jstring)
-        if score < maxscore:
+        if failed:
             sys.exit(1)
 
 def usage(name):
@@ -0,0 +1,40 @@
+/* Monotonic, high-resolution timing */
+
+#include <time.h>
+
+#include "timing.h"
+
+/* Interval the cycle counter is calibrated over */
+#define CALIBRATE_NS 10000000
+
+static timing_t origin;
+static double ns_per_cycle = 0;
+
+int64_t timing_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+    return (int64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void timing_init(void)
+{
+    origin = timing_now();
+
+    /* Let both run for a while, then compare them */
+    struct timespec ts = {0, CALIBRATE_NS};
+    nanosleep(&ts, NULL);
+    timing_t delta = timing_since(origin);
+    while (delta.ns < CALIBRATE_NS)
+        delta = timing_since(origin);
+
+    /* A counter that does not advance cannot be converted */
+    ns_per_cycle = delta.cycles > 0 ? (double) delta.ns / delta.cycles : 0;
+}
+
+double timing_ns_per_cycle(void)
+{
+    if (!origin.ns)
+        timing_init();
+    return ns_per_cycle;
+}
@@ -0,0 +1,56 @@
+#ifndef LAB0_TIMING_H
+#define LAB0_TIMING_H
+
+#include <stdint.h>
+
+#include "dudect/cpucycles.h"
+
+/* Monotonic, high-resolution timing shared by the console, the benchmarks
+ * and dudect.
+ *
+ * Time comes from CLOCK_MONOTONIC_RAW, which is never stepped nor slewed,
+ * and is paired with the CPU cycle counter (rdtsc / cntvct_el0).  The rate
+ * of the cycle counter is calibrated against the clock at startup.
+ */
+
+/* Point in time, or interval between two points */
+typedef struct {
+    int64_t ns;
+    int64_t cycles;
+} timing_t;
+
+/* Calibrate the cycle counter, which takes about 10 ms.  Call once at
+ * startup.
+ */
+void timing_init(void);
+
+/* Nanoseconds elapsed on CLOCK_MONOTONIC_RAW */
+int64_t timing_ns(void);
+
+/* Raw value of the cycle counter */
+static inline int64_t timing_cycles(void)
+{
+    return cpucycles();
+}
+
+/* Current point in time */
+static inline timing_t timing_now(void)
+{
+    timing_t t = {timing_ns(), timing_cycles()};
+    return t;
+}
+
+/* Interval from start until now */
+static inline timing_t timing_since(timing_t start)
+{
+    timing_t now = timing_now();
+    timing_t delta = {now.ns - start.ns, now.cycles - start.cycles};
+    return delta;
+}
+
+/* Nanoseconds per tick of the cycle counter, as measured by timing_init().
+ * 0 if the counter does not advance.
+ */
+double timing_ns_per_cycle(void);
+
+#endif /* LAB0_TIMING_H */
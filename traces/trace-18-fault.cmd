@@ -0,0 +1,17 @@
+# Test deterministic malloc failure schedules: the Nth, every Kth, and seeded
+option fail 30
+new
+option malloc_nth 3
+ih dolphin 6
+option malloc_nth 0
+option malloc_every 4
+it gerbil 8
+option malloc_every 0
+option malloc_seed 5
+option malloc 30
+ih zebra 10
+rh
+rt
+option malloc 0
+size
+free
@@ -0,0 +1,17 @@
+# Test poisoning every Nth block, also while allocations fail
+option fail 10
+new
+option poison 0
+ih kiwi 4
+option poison 3
+it lime 6
+rh kiwi
+rt lime
+option malloc_every 3
+ih mango 4
+option malloc_every 0
+option poison 1
+reverse
+rh lime
+size
+free
@@ -0,0 +1,12 @@
+# Test microsecond time limits, and an operation overrunning its budget
+option expect_errors 1
+new
+ih apple 1000
+option timelimit_us 1000000
+size 10
+rh apple
+option timelimit_us 20000
+size 1000000
+option timelimit_us 0
+size
+free
@@ -0,0 +1,7 @@
+# Test replaying a compiled trace, and rejecting a corrupt one
+option expect_errors 1
+compile traces/trace-01-ops.cmd /tmp/qtest.trace-21.bin
+source /tmp/qtest.trace-21.bin
+show
+source traces/trace-21-corrupt.bin
+free
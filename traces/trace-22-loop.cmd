@@ -0,0 +1,23 @@
+# Test repeat and nested loops, timed and not, sourcing a file within a loop,
+# which is refused, and a loop left without its end
+option expect_errors 5
+new
+repeat 5 ih dolphin
+loop 3
+it gerbil
+loop 2
+rh
+end
+end
+time repeat 4 ih bear
+time loop 2
+it zebra
+end
+size
+repeat 2 source traces/trace-eg.cmd
+loop 1
+source traces/trace-eg.cmd
+end
+size
+loop 2
+ih never
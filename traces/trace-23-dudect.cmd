@@ -0,0 +1,10 @@
+# Test that the options running the dudect t-tests pass their self-checks,
+# and that an invalid sequential mode is refused
+option expect_errors 1
+option dudect_threads 2
+option dudect_threads 0
+option dudect_threads 1
+option dudect_sequential 1
+option dudect_sequential 0
+# Not a valid mode
+option dudect_sequential 2
@@ -4,16 +4,29 @@
 
 #include <arpa/inet.h> /* inet_ntoa */
 #include <errno.h>
+#include <fcntl.h>
 #include <netinet/tcp.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
 #include <unistd.h>
 
+#if defined(__linux__)
+#include <sys/sendfile.h>
+#define HAVE_SENDFILE 1
+#endif
+
+#include "http.h"
+#include "timing.h"
+#include "web.h"
+
 #define LISTENQ 1024 /* second argument to listen() */
-#define MAXLINE 1024 /* max length of a line */
-#define BUFSIZE 1024
 
 #ifndef DEFAULT_PORT
 #define DEFAULT_PORT 9999 /* use this port if none given as arg to main() */
@@ -23,56 +36,85 @@
 #define TCP_CORK TCP_NOPUSH
 #endif
 
-typedef struct {
-    int fd;            /* descriptor for this buf */
-    int count;         /* unread byte in this buf */
-    char *bufptr;      /* next unread byte in this buf */
-    char buf[BUFSIZE]; /* internal buffer */
-} rio_t;
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
 
-typedef struct {
-    char filename[512];
-    off_t offset; /* for support Range */
-    size_t end;
-} http_request_t;
+/* Largest request, headers included, that a connection buffers */
+#define REQUEST_MAX 8192
 
-static void rio_readinitb(rio_t *rp, int fd)
-{
-    rp->fd = fd;
-    rp->count = 0;
-    rp->bufptr = rp->buf;
-}
+/* Most requests waiting for the handler at once */
+#define WEB_QUEUE_LEN 64
+
+/* Clients are closed after this long without a request */
+#define WEB_IDLE_NS (15 * 1000000000LL)
 
-/* This is a wrapper for the Unix read() function that transfers min(n, count)
- * bytes from an internal buffer to a user buffer, where n is the number of
- * bytes requested by the user and count is the number of unread bytes in the
- * internal buffer. On entry, rio_read() refills the internal buffer via a call
- * to read() if the internal buffer is empty.
+/* Output of a response is gathered into chunks of this size */
+#define WEB_CHUNK_SIZE 16384
+
+/* Most buffers gathered by one send */
+#define WEB_IOV_MAX 16
+
+typedef enum {
+    CONN_READING, /* Waiting for a complete request */
+    CONN_WAITING, /* Waiting for room in the queue */
+    CONN_RUNNING, /* Queued, or being answered by the handler */
+    CONN_WRITING, /* Answered, sending the rest of the response */
+} conn_state_t;
+
+/* Part of a response, framing included, waiting to be sent: either len
+ * bytes of data, or len bytes of the file fd from offset.
  */
-/* $begin rio_read */
-static ssize_t rio_read(rio_t *rp, char *usrbuf, size_t n)
-{
-    int cnt;
-    while (rp->count <= 0) { /* refill if buf is empty */
-        rp->count = read(rp->fd, rp->buf, sizeof(rp->buf));
-        if (rp->count < 0) {
-            if (errno != EINTR) /* interrupted by sig handler return */
-                return -1;
-        } else if (rp->count == 0) { /* EOF */
-            return 0;
-        } else
-            rp->bufptr = rp->buf; /* reset buffer ptr */
-    }
-
-    /* Copy min(n, rp->count) bytes from internal buf to user buf */
-    cnt = n;
-    if (rp->count < n)
-        cnt = rp->count;
-    memcpy(usrbuf, rp->bufptr, cnt);
-    rp->bufptr += cnt;
-    rp->count -= cnt;
-    return cnt;
-}
+typedef struct __web_buf {
+    struct __web_buf *next;
+    size_t len;
+    int fd; /* -1 for data */
+    off_t offset;
+    char data[];
+} web_buf_t;
+
+typedef struct __web_conn web_conn_t;
+
+struct __web_response {
+    web_conn_t *conn;
+    int status;
+    const char *type;
+    bool started; /* Header sent */
+    bool ended;   /* Complete, Content-Length given */
+    size_t pending_len;
+    char pending[WEB_CHUNK_SIZE]; /* Output not sent yet */
+};
+
+/* Client connection.  Requests may arrive pipelined, several at a time,
+ * and the connection is kept open between them.
+ *
+ * Only the server thread touches a connection, except that the handler
+ * owns path and resp while the connection is running, and that the
+ * response is passed from the handler through out, under job_lock.
+ */
+struct __web_conn {
+    int fd;
+    conn_state_t state;
+    bool eof;    /* The client sent everything it will */
+    bool failed; /* The response could not be sent */
+    int64_t last_active;
+    http_parser_t req; /* Of the current request */
+    char *path;        /* Command of the current request, in buf */
+    size_t start;      /* Offset of the unparsed input in buf */
+    size_t len;        /* Bytes buffered */
+    char buf[REQUEST_MAX];
+    web_response_t resp;
+    /* Passed from the handler */
+    web_buf_t *out, **out_tail;
+    bool finished; /* The handler is done with the request */
+    bool listed;   /* In done_list */
+    /* Being sent */
+    web_buf_t *send, **send_tail;
+    size_t sent; /* Bytes of the first buffer sent */
+    struct __web_conn *prev, *next;
+    struct __web_conn *next_waiting;
+    struct __web_conn *next_done;
+};
 
 static ssize_t writen(int fd, void *usrbuf, size_t n)
 {
@@ -93,29 +135,6 @@ static ssize_t writen(int fd, void *usrbuf, size_t n)
     return n;
 }
 
-/* robustly read a text line (buffered) */
-static ssize_t rio_readlineb(rio_t *rp, void *usrbuf, size_t maxlen)
-{
-    char c, *bufp = usrbuf;
-
-    int n;
-    for (n = 1; n < maxlen; n++) {
-        int rc;
-        if ((rc = rio_read(rp, &c, 1)) == 1) {
-            *bufp++ = c;
-            if (c == '\n')
-                break;
-        } else if (rc == 0) {
-            if (n == 1)
-                return 0; /* EOF, no data read */
-            break;        /* EOF, some data was read */
-        } else
-            return -1; /* error */
-    }
-    *bufp = 0;
-    return n;
-}
-
 void web_send(int out_fd, char *buf)
 {
     writen(out_fd, buf, strlen(buf));
@@ -156,75 +175,795 @@ int web_open(int port)
     return listenfd;
 }
 
-static void url_decode(char *src, char *dest, int max)
+/* Take the next complete request from the buffer.
+ * Return the command it carries, with '/' turned into spaces, or NULL if no
+ * complete request is buffered.  *bad is set if the request is malformed.
+ */
+static char *conn_request(web_conn_t *conn, bool *bad)
 {
-    char *p = src;
-    char code[3] = {0};
-    while (*p && --max) {
-        if (*p == '%') {
-            memcpy(code, ++p, 2);
-            *dest++ = (char) strtoul(code, NULL, 16);
-            p += 2;
-        } else {
-            *dest++ = *p++;
+    /* Finish discarding the body of the previous request */
+    conn->start += http_skip_body(&conn->req, conn->len - conn->start);
+    if (conn->req.body_left)
+        return NULL;
+
+    char *buf = conn->buf + conn->start;
+    ssize_t n = http_parse(&conn->req, buf, conn->len - conn->start);
+    *bad = n < 0;
+    if (n <= 0)
+        return NULL;
+    conn->start += n;
+
+    char *path = buf + conn->req.path;
+    if (*path == '/') {
+        path++;
+        /* The buffer still holds the '/' */
+        if (!*path)
+            strcpy(--path, ".");
+    }
+    /* Change '/' to ' ' */
+    for (char *p = path; *p;) {
+        if (*++p == '/')
+            *p = ' ';
+    }
+    return path;
+}
+
+/* Buffer whatever the client has sent, without blocking.
+ * Return false once the client has closed the connection, on error, or when
+ * a request does not fit in the buffer.
+ */
+static bool conn_read(web_conn_t *conn)
+{
+    /* Make room by moving the unparsed input to the front */
+    if (conn->start == conn->len) {
+        conn->start = conn->len = 0;
+    } else if (conn->len == REQUEST_MAX) {
+        conn->len -= conn->start;
+        memmove(conn->buf, conn->buf + conn->start, conn->len);
+        conn->start = 0;
+    }
+    /* Everything that could be parsed was, so the request is too long */
+    if (conn->len == REQUEST_MAX)
+        return false;
+
+    while (conn->len < REQUEST_MAX) {
+        ssize_t n = recv(conn->fd, conn->buf + conn->len,
+                         REQUEST_MAX - conn->len, MSG_DONTWAIT);
+        if (n > 0) {
+            conn->len += n;
+            continue;
         }
+        if (n < 0 && errno == EINTR)
+            continue;
+        return n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+    }
+    return true;
+}
+
+/* Requests waiting for the handler, from the server thread */
+static web_conn_t *job_ring[WEB_QUEUE_LEN];
+static size_t job_head = 0, job_cnt = 0;
+
+/* Connections with response output to send, back to the server thread */
+static web_conn_t *done_list = NULL;
+static bool stopping = false;
+
+static pthread_mutex_t job_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Each pipe wakes the loop of the thread at its read end */
+static int job_pipe[2] = {-1, -1};
+static int done_pipe[2] = {-1, -1};
+
+static void wake(int fd)
+{
+    char c = 0;
+    /* A full pipe already wakes the reader */
+    while (write(fd, &c, 1) < 0 && errno == EINTR)
+        ;
+}
+
+static void drain(int fd)
+{
+    char buf[64];
+    while (read(fd, buf, sizeof(buf)) > 0)
+        ;
+}
+
+/* Queue the request of conn for the handler.  Return false if full */
+static bool job_push(web_conn_t *conn)
+{
+    pthread_mutex_lock(&job_lock);
+    bool ok = job_cnt < WEB_QUEUE_LEN;
+    bool was_empty = job_cnt == 0;
+    if (ok)
+        job_ring[(job_head + job_cnt++) % WEB_QUEUE_LEN] = conn;
+    pthread_mutex_unlock(&job_lock);
+    /* The handler takes every queued request once woken */
+    if (ok && was_empty)
+        wake(job_pipe[1]);
+    return ok;
+}
+
+static web_conn_t *job_pop(void)
+{
+    web_conn_t *conn = NULL;
+    pthread_mutex_lock(&job_lock);
+    if (job_cnt) {
+        conn = job_ring[job_head];
+        job_head = (job_head + 1) % WEB_QUEUE_LEN;
+        job_cnt--;
+    }
+    pthread_mutex_unlock(&job_lock);
+    return conn;
+}
+
+/* Pass buf, which may be NULL, on to be sent.  finished tells that it
+ * ends the response.
+ */
+static void out_push(web_conn_t *conn, web_buf_t *buf, bool finished)
+{
+    pthread_mutex_lock(&job_lock);
+    if (buf) {
+        buf->next = NULL;
+        *conn->out_tail = buf;
+        conn->out_tail = &buf->next;
+    }
+    conn->finished |= finished;
+    bool was_empty = !done_list;
+    if (!conn->listed) {
+        conn->listed = true;
+        conn->next_done = done_list;
+        done_list = conn;
+    }
+    pthread_mutex_unlock(&job_lock);
+    if (was_empty)
+        wake(done_pipe[1]);
+}
+
+static void free_bufs(web_buf_t *buf)
+{
+    while (buf) {
+        web_buf_t *next = buf->next;
+        if (buf->fd >= 0)
+            close(buf->fd);
+        free(buf);
+        buf = next;
     }
-    *dest = '\0';
 }
 
-static void parse_request(int fd, http_request_t *req)
+/* State of the server thread */
+static event_loop_t *io_loop = NULL;
+static pthread_t io_thread;
+static int listen_fd = -1;
+static web_conn_t *conns = NULL;
+/* Connections with a request that did not fit in the queue, oldest first */
+static web_conn_t *waiting = NULL;
+static web_conn_t **waiting_tail = &waiting;
+
+/* Loop running the handler, and the connection it answers */
+static event_loop_t *exec_loop = NULL;
+static web_handler_t web_handler = NULL;
+static web_conn_t *current = NULL;
+
+static void conn_ready(int fd, int events, void *arg);
+
+static void conn_free(web_conn_t *conn)
 {
-    rio_t rio;
-    char buf[MAXLINE], method[MAXLINE], uri[MAXLINE];
-    req->offset = 0;
-    req->end = 0; /* default */
+    free_bufs(conn->out);
+    free_bufs(conn->send);
+    free(conn);
+}
 
-    rio_readinitb(&rio, fd);
-    rio_readlineb(&rio, buf, MAXLINE);
-    sscanf(buf, "%1023s %1023s", method, uri); /* version is not cared */
-    /* read all */
-    while (buf[0] != '\n' && buf[1] != '\n') { /* \n || \r\n */
-        rio_readlineb(&rio, buf, MAXLINE);
-        if (buf[0] == 'R' && buf[1] == 'a' && buf[2] == 'n') {
-            sscanf(buf, "Range: bytes=%lu-%lu", (unsigned long *) &req->offset,
-                   (unsigned long *) &req->end);
-            /* Range: [start, end] */
-            if (req->end != 0)
-                req->end++;
+/* Forget about the connection and close its socket */
+static void conn_unlink(web_conn_t *conn)
+{
+    if (conn->prev)
+        conn->prev->next = conn->next;
+    else
+        conns = conn->next;
+    if (conn->next)
+        conn->next->prev = conn->prev;
+
+    event_del(io_loop, conn->fd);
+    close(conn->fd);
+}
+
+static void conn_close(web_conn_t *conn)
+{
+    conn_unlink(conn);
+    conn_free(conn);
+}
+
+/* Watch the connection for events, closing it on failure */
+static bool conn_watch(web_conn_t *conn, int events)
+{
+    if (event_add(io_loop, conn->fd, events, conn_ready, conn))
+        return true;
+    if (conn->state == CONN_RUNNING)
+        conn->failed = true;
+    else
+        conn_close(conn);
+    return false;
+}
+
+/* Answer to a malformed request, after which the connection is closed */
+static const char bad_request[] =
+    "HTTP/1.1 400 Bad Request\r\nContent-Type: text/plain\r\n"
+    "Content-Length: 12\r\nConnection: close\r\n\r\nBad request\n";
+
+/* Hand the next buffered request over to the handler, or wait for one */
+static void conn_next(web_conn_t *conn)
+{
+    bool bad = false;
+    if (!(conn->path = conn_request(conn, &bad))) {
+        if (bad) {
+            /* Short enough for the socket to take at once.  The connection
+             * is closed whether it does or not.
+             */
+            send(conn->fd, bad_request, sizeof(bad_request) - 1, MSG_NOSIGNAL);
+            conn_close(conn);
+        } else if (conn->eof) {
+            conn_close(conn);
+        } else {
+            conn_watch(conn, EVENT_READ);
         }
+        return;
     }
-    char *filename = uri;
-    if (uri[0] == '/') {
-        filename = uri + 1;
-        int length = strlen(filename);
-        if (length == 0) {
-            filename = ".";
+
+    /* Nothing more is read until the response is sent */
+    event_del(io_loop, conn->fd);
+    conn->out_tail = &conn->out;
+    conn->send_tail = &conn->send;
+    conn->finished = false;
+    conn->failed = false;
+    if (job_push(conn)) {
+        conn->state = CONN_RUNNING;
+        return;
+    }
+    conn->state = CONN_WAITING;
+    conn->next_waiting = NULL;
+    *waiting_tail = conn;
+    waiting_tail = &conn->next_waiting;
+}
+
+/* Send part of the file of buf, starting sent bytes into it.
+ * Return the number of bytes sent, 0 if the file ends early, or -1.
+ */
+static ssize_t send_file(int sock, const web_buf_t *buf, size_t sent)
+{
+    off_t off = buf->offset + sent;
+    size_t len = buf->len - sent;
+#ifdef HAVE_SENDFILE
+    return sendfile(sock, buf->fd, &off, len);
+#else
+    /* Copy through a buffer instead, rereading what the socket refused */
+    char data[16384];
+    ssize_t n = pread(buf->fd, data, len < sizeof(data) ? len : sizeof(data),
+                      off);
+    if (n <= 0)
+        return n;
+    return send(sock, data, n, MSG_NOSIGNAL);
+#endif
+}
+
+/* Send what the socket takes of the response so far */
+static void conn_write(web_conn_t *conn)
+{
+    while (conn->send && !conn->failed) {
+        ssize_t n;
+        if (conn->send->fd >= 0) {
+            n = send_file(conn->fd, conn->send, conn->sent);
+            /* The file was truncated under us */
+            if (n == 0) {
+                conn->failed = true;
+                break;
+            }
         } else {
-            for (int i = 0; i < length; ++i) {
-                if (filename[i] == '?') {
-                    filename[i] = '\0';
-                    break;
-                }
+            struct iovec iov[WEB_IOV_MAX];
+            int cnt = 0;
+            size_t off = conn->sent;
+            for (web_buf_t *b = conn->send; b && b->fd < 0 && cnt < WEB_IOV_MAX;
+                 b = b->next) {
+                iov[cnt].iov_base = b->data + off;
+                iov[cnt++].iov_len = b->len - off;
+                off = 0;
             }
+            struct msghdr msg = {.msg_iov = iov, .msg_iovlen = cnt};
+            n = sendmsg(conn->fd, &msg, MSG_NOSIGNAL);
+        }
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            conn_watch(conn, EVENT_WRITE);
+            return;
+        }
+        if (n < 0) {
+            conn->failed = true;
+            break;
         }
+
+        conn->sent += n;
+        while (conn->send && conn->sent >= conn->send->len) {
+            web_buf_t *b = conn->send;
+            conn->sent -= b->len;
+            conn->send = b->next;
+            free(b);
+        }
+    }
+
+    if (conn->failed) {
+        free_bufs(conn->send);
+        conn->send = NULL;
+        conn->sent = 0;
     }
-    url_decode(filename, req->filename, MAXLINE);
+    if (!conn->send)
+        conn->send_tail = &conn->send;
+
+    /* Wait for more of the response */
+    if (conn->state == CONN_RUNNING) {
+        event_del(io_loop, conn->fd);
+        return;
+    }
+
+    if (conn->failed || !conn->req.keep_alive) {
+        conn_close(conn);
+        return;
+    }
+    conn->state = CONN_READING;
+    conn->last_active = timing_ns();
+    conn_next(conn);
 }
 
-char *web_recv(int fd, struct sockaddr_in *clientaddr)
+static void conn_ready(int fd, int events, void *arg)
 {
-    http_request_t req;
-    parse_request(fd, &req);
+    web_conn_t *conn = arg;
+    if (conn->state != CONN_READING) {
+        conn_write(conn);
+        return;
+    }
 
-    char *p = req.filename;
-    /* Change '/' to ' ' */
-    while (*p) {
-        ++p;
-        if (*p == '/')
-            *p = ' ';
+    if (!conn_read(conn))
+        conn->eof = true;
+    conn->last_active = timing_ns();
+    conn_next(conn);
+}
+
+/* A client is connecting */
+static void accept_ready(int fd, int events, void *arg)
+{
+    for (;;) {
+        struct sockaddr_in clientaddr;
+        socklen_t clientlen = sizeof(clientaddr);
+        int connfd = accept(fd, (struct sockaddr *) &clientaddr, &clientlen);
+        if (connfd < 0) {
+            if (errno == EINTR)
+                continue;
+            return;
+        }
+
+        web_conn_t *conn = calloc(1, sizeof(web_conn_t));
+        if (!conn) {
+            close(connfd);
+            continue;
+        }
+        /* sendfile() has no flag to keep it from blocking */
+        fcntl(connfd, F_SETFL, fcntl(connfd, F_GETFL) | O_NONBLOCK);
+        conn->fd = connfd;
+        conn->state = CONN_READING;
+        conn->last_active = timing_ns();
+        conn->resp.conn = conn;
+
+        /* Responses on a kept-alive connection must not wait for more data */
+        int off = 0, on = 1;
+        setsockopt(connfd, IPPROTO_TCP, TCP_CORK, &off, sizeof(off));
+        setsockopt(connfd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+
+        conn->next = conns;
+        if (conns)
+            conns->prev = conn;
+        conns = conn;
+        conn_watch(conn, EVENT_READ);
+    }
+}
+
+/* The handler has output for some connections */
+static void done_ready(int fd, int events, void *arg)
+{
+    drain(fd);
+    pthread_mutex_lock(&job_lock);
+    web_conn_t *conn = done_list;
+    done_list = NULL;
+    for (web_conn_t *c = conn; c; c = c->next_done) {
+        c->listed = false;
+        if (c->out) {
+            *c->send_tail = c->out;
+            c->send_tail = c->out_tail;
+            c->out = NULL;
+            c->out_tail = &c->out;
+        }
+        if (c->finished)
+            c->state = CONN_WRITING;
+    }
+    pthread_mutex_unlock(&job_lock);
+
+    while (conn) {
+        web_conn_t *next = conn->next_done;
+        conn_write(conn);
+        conn = next;
+    }
+
+    /* Room was made in the queue */
+    while (waiting && job_push(waiting)) {
+        waiting->state = CONN_RUNNING;
+        waiting = waiting->next_waiting;
+    }
+    if (!waiting)
+        waiting_tail = &waiting;
+}
+
+/* Close the connections of idle clients */
+static void sweep(void *arg)
+{
+    int64_t now = timing_ns();
+    web_conn_t *conn = conns;
+    while (conn) {
+        web_conn_t *next = conn->next;
+        if (conn->state == CONN_READING &&
+            now - conn->last_active > WEB_IDLE_NS)
+            conn_close(conn);
+        conn = next;
+    }
+}
+
+static void *io_run(void *arg)
+{
+    for (;;) {
+        pthread_mutex_lock(&job_lock);
+        bool stop = stopping;
+        pthread_mutex_unlock(&job_lock);
+        if (stop || event_run_once(io_loop, -1) < 0)
+            break;
+    }
+    return NULL;
+}
+
+static const char *status_text(int status)
+{
+    switch (status) {
+    case 200:
+        return "OK";
+    case 206:
+        return "Partial Content";
+    case 404:
+        return "Not Found";
+    case 416:
+        return "Range Not Satisfiable";
+    case 500:
+        return "Internal Server Error";
+    default:
+        return "Error";
+    }
+}
+
+/* New buffer with room for size bytes, starting with the response header
+ * unless it has been sent already.  fields are the header fields that tell
+ * the length of the response.
+ */
+static web_buf_t *resp_buf(web_response_t *resp,
+                           const char *fields,
+                           size_t size)
+{
+    char header[512];
+    int n = 0;
+    if (!resp->started) {
+        web_conn_t *conn = resp->conn;
+        n = snprintf(header, sizeof(header),
+                     "HTTP/1.1 %d %s\r\nContent-Type: %s\r\n%s"
+                     "Connection: %s\r\n\r\n",
+                     resp->status, status_text(resp->status),
+                     resp->type ? resp->type : "text/plain", fields,
+                     conn->req.keep_alive ? "keep-alive" : "close");
+        if (n >= (int) sizeof(header))
+            n = sizeof(header) - 1;
+    }
+
+    web_buf_t *buf = malloc(sizeof(web_buf_t) + n + size);
+    if (!buf)
+        return NULL;
+    memcpy(buf->data, header, n);
+    buf->len = n;
+    buf->fd = -1;
+    resp->started = true;
+    return buf;
+}
+
+/* Header fields of a response sent as it is written */
+static const char *stream_fields(const web_conn_t *conn)
+{
+    return conn->req.http11 ? "Transfer-Encoding: chunked\r\n" : "";
+}
+
+void web_set_status(web_response_t *resp, int status)
+{
+    resp->status = status;
+}
+
+void web_set_type(web_response_t *resp, const char *type)
+{
+    resp->type = type;
+}
+
+/* Send data as one chunk, the last one if last is set */
+static void resp_chunk(web_response_t *resp,
+                       const char *data,
+                       size_t len,
+                       bool last)
+{
+    web_conn_t *conn = resp->conn;
+    web_buf_t *buf = resp_buf(resp, stream_fields(conn), len + 32);
+    if (!buf)
+        return;
+    if (conn->req.http11 && len)
+        buf->len += sprintf(buf->data + buf->len, "%lx\r\n", len);
+    memcpy(buf->data + buf->len, data, len);
+    buf->len += len;
+    if (conn->req.http11 && len) {
+        memcpy(buf->data + buf->len, "\r\n", 2);
+        buf->len += 2;
+    }
+    if (conn->req.http11 && last) {
+        memcpy(buf->data + buf->len, "0\r\n\r\n", 5);
+        buf->len += 5;
+    }
+    if (!buf->len) {
+        free(buf);
+        buf = NULL;
+    }
+    out_push(conn, buf, last);
+}
+
+static void resp_flush(web_response_t *resp)
+{
+    if (resp->pending_len)
+        resp_chunk(resp, resp->pending, resp->pending_len, false);
+    resp->pending_len = 0;
+}
+
+void web_write(web_response_t *resp, const char *data, size_t len)
+{
+    /* The server may have been stopped by the command being answered */
+    if (!len || resp->ended || !io_loop)
+        return;
+
+    if (resp->pending_len + len > WEB_CHUNK_SIZE)
+        resp_flush(resp);
+    if (len >= WEB_CHUNK_SIZE) {
+        resp_chunk(resp, data, len, false);
+        return;
+    }
+    memcpy(resp->pending + resp->pending_len, data, len);
+    resp->pending_len += len;
+}
+
+void web_printf(web_response_t *resp, const char *fmt, ...)
+{
+    if (resp->ended || !io_loop)
+        return;
+
+    va_list ap;
+    va_start(ap, fmt);
+    size_t room = WEB_CHUNK_SIZE - resp->pending_len;
+    int n = vsnprintf(resp->pending + resp->pending_len, room, fmt, ap);
+    va_end(ap);
+    if (n < 0)
+        return;
+    if ((size_t) n < room) {
+        resp->pending_len += n;
+        return;
+    }
+
+    /* Did not fit in what was left of the chunk */
+    char *buf = malloc(n + 1);
+    if (!buf)
+        return;
+    va_start(ap, fmt);
+    vsnprintf(buf, n + 1, fmt, ap);
+    va_end(ap);
+    web_write(resp, buf, n);
+    free(buf);
+}
+
+bool web_send_file(web_response_t *resp, const char *path)
+{
+    if (resp->started || resp->pending_len || !io_loop)
+        return false;
+
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (fd < 0)
+        return false;
+    if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode)) {
+        close(fd);
+        return false;
+    }
+
+    /* Bytes first to last, of size in all */
+    const http_parser_t *req = &resp->conn->req;
+    web_conn_t *conn = resp->conn;
+    long long size = st.st_size, first = 0, last = size - 1;
+    char fields[256];
+    if (req->range) {
+        if (req->range_first < 0) {
+            first = size > req->range_last ? size - req->range_last : 0;
+        } else {
+            first = req->range_first;
+            if (req->range_last >= 0 && req->range_last < last)
+                last = req->range_last;
+        }
+    }
+    int status = resp->status;
+    if (first > last && req->range) {
+        resp->status = 416;
+        snprintf(fields, sizeof(fields),
+                 "Content-Range: bytes */%lld\r\nContent-Length: 0\r\n", size);
+    } else if (req->range) {
+        resp->status = 206;
+        snprintf(fields, sizeof(fields),
+                 "Accept-Ranges: bytes\r\nContent-Range: bytes %lld-%lld/%lld"
+                 "\r\nContent-Length: %lld\r\n",
+                 first, last, size, last - first + 1);
+    } else {
+        snprintf(fields, sizeof(fields),
+                 "Accept-Ranges: bytes\r\nContent-Length: %lld\r\n", size);
+    }
+
+    web_buf_t *header = resp_buf(resp, fields, 0);
+    web_buf_t *body = NULL;
+    if (header && first <= last && !(body = malloc(sizeof(web_buf_t)))) {
+        free(header);
+        header = NULL;
+        resp->started = false;
+    }
+    if (!header) {
+        resp->status = status;
+        close(fd);
+        return false;
+    }
+
+    out_push(conn, header, false);
+    if (body) {
+        body->len = last - first + 1;
+        body->fd = fd;
+        body->offset = first;
+        out_push(conn, body, false);
+    } else {
+        close(fd);
+    }
+    resp->ended = true;
+    return true;
+}
+
+/* End the response, with the last chunk when chunked */
+static void resp_finish(web_response_t *resp)
+{
+    if (resp->ended)
+        out_push(resp->conn, NULL, true);
+    else
+        resp_chunk(resp, resp->pending, resp->pending_len, true);
+}
+
+/* Requests are queued for the handler */
+static void job_ready(int fd, int events, void *arg)
+{
+    drain(fd);
+    while (io_loop && (current = job_pop())) {
+        current->resp.status = 200;
+        current->resp.type = NULL;
+        current->resp.started = false;
+        current->resp.ended = false;
+        current->resp.pending_len = 0;
+        web_handler(current->path, &current->resp);
+        /* The handler may have stopped the server */
+        if (!io_loop) {
+            conn_free(current);
+            current = NULL;
+            return;
+        }
+        resp_finish(&current->resp);
+        current = NULL;
+    }
+}
+
+static bool nonblocking_pipe(int fds[2])
+{
+    if (pipe(fds) < 0)
+        return false;
+    for (int i = 0; i < 2; i++) {
+        fcntl(fds[i], F_SETFL, fcntl(fds[i], F_GETFL) | O_NONBLOCK);
+        fcntl(fds[i], F_SETFD, FD_CLOEXEC);
+    }
+    return true;
+}
+
+static void close_pipe(int fds[2])
+{
+    for (int i = 0; i < 2; i++) {
+        if (fds[i] >= 0)
+            close(fds[i]);
+        fds[i] = -1;
+    }
+}
+
+bool web_start(int port, event_loop_t *loop, web_handler_t handler)
+{
+    if (io_loop)
+        return false;
+
+    listen_fd = web_open(port);
+    if (listen_fd < 0)
+        return false;
+    fcntl(listen_fd, F_SETFL, fcntl(listen_fd, F_GETFL) | O_NONBLOCK);
+
+    exec_loop = loop;
+    web_handler = handler;
+    stopping = false;
+    io_loop = event_loop_new();
+    if (!io_loop || !nonblocking_pipe(job_pipe) ||
+        !nonblocking_pipe(done_pipe) ||
+        !event_add(io_loop, listen_fd, EVENT_READ, accept_ready, NULL) ||
+        !event_add(io_loop, done_pipe[0], EVENT_READ, done_ready, NULL) ||
+        event_timer_add(io_loop, 1000, true, sweep, NULL) < 0 ||
+        !event_add(exec_loop, job_pipe[0], EVENT_READ, job_ready, NULL))
+        goto fail;
+
+    /* Signals, such as the alarm of the harness, are for the main thread */
+    sigset_t all, old;
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    int err = pthread_create(&io_thread, NULL, io_run, NULL);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    if (err == 0)
+        return true;
+
+    event_del(exec_loop, job_pipe[0]);
+fail:
+    event_loop_free(io_loop);
+    io_loop = NULL;
+    close_pipe(job_pipe);
+    close_pipe(done_pipe);
+    close(listen_fd);
+    listen_fd = -1;
+    return false;
+}
+
+void web_stop(void)
+{
+    if (!io_loop)
+        return;
+
+    pthread_mutex_lock(&job_lock);
+    stopping = true;
+    pthread_mutex_unlock(&job_lock);
+    wake(done_pipe[1]);
+    pthread_join(io_thread, NULL);
+
+    /* A connection the handler is answering is released by the handler */
+    while (conns) {
+        web_conn_t *conn = conns;
+        conn_unlink(conn);
+        if (conn != current)
+            conn_free(conn);
     }
-    char *ret = malloc(strlen(req.filename) + 1);
-    strncpy(ret, req.filename, strlen(req.filename) + 1);
+    waiting = NULL;
+    waiting_tail = &waiting;
+    done_list = NULL;
+    job_head = job_cnt = 0;
 
-    return ret;
+    event_del(exec_loop, job_pipe[0]);
+    event_loop_free(io_loop);
+    io_loop = NULL;
+    close_pipe(job_pipe);
+    close_pipe(done_pipe);
+    close(listen_fd);
+    listen_fd = -1;
 }
@@ -2,11 +2,63 @@
 #define TINYWEB_H
 
 #include <netinet/in.h>
+#include <stdbool.h>
+#include <stddef.h>
 
-int web_open(int port);
+#include "event.h"
 
-char *web_recv(int fd, struct sockaddr_in *clientaddr);
+int web_open(int port);
 
 void web_send(int out_fd, char *buffer);
 
+/* Response to a request, sent while it is written */
+typedef struct __web_response web_response_t;
+
+/* Status of the response, 200 unless set before the first write */
+void web_set_status(web_response_t *resp, int status);
+
+/* Content type of the response, "text/plain" unless set before the first
+ * write.
+ */
+void web_set_type(web_response_t *resp, const char *type);
+
+/* Add len bytes to the response.  Output is sent in chunks of a chunked
+ * response as soon as a chunk fills up, so that clients see long outputs
+ * as they are produced and can still tell where a response ends on a
+ * kept-alive connection.
+ */
+void web_write(web_response_t *resp, const char *data, size_t len);
+
+/* Add formatted output to the response, as web_write() */
+void web_printf(web_response_t *resp, const char *fmt, ...)
+    __attribute__((format(printf, 2, 3)));
+
+/* Answer with the file at path, or with the byte range of it that the
+ * client asked for.  The file is sent by the server thread with sendfile()
+ * where available, without copying it through user space.  Return false,
+ * leaving the response untouched, if nothing was written yet and the file
+ * cannot be read.
+ */
+bool web_send_file(web_response_t *resp, const char *path);
+
+/* Answer the request for cmd, the path of the request with '/' turned into
+ * spaces.  The response ends when the handler returns.
+ */
+typedef void (*web_handler_t)(char *cmd, web_response_t *resp);
+
+/* Serve port with many concurrent clients.
+ *
+ * Connections are accepted, read and written by a thread of their own, and
+ * requests may arrive pipelined and over kept-alive connections.  The
+ * requests are queued, and handler is called for each of them, one at a
+ * time, from the thread running loop.  Everything the handler touches thus
+ * stays single-threaded.
+ */
+bool web_start(int port, event_loop_t *loop, web_handler_t handler);
+
+/* Close every connection and stop the server thread.
+ * Must be called from the thread running the loop passed to web_start().
+ */
+void web_stop(void);
+
 #endif
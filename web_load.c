@@ -0,0 +1,471 @@
+/* Load generator for the web server of qtest.
+ *
+ * Opens concurrent connections to the web port on localhost and replays the
+ * commands of a trace file as GET requests, each command line turned into a
+ * path with its spaces as '/', as the server decodes it.  Reports the
+ * throughput and the percentiles of the latency of the requests.
+ */
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "event.h"
+#include "timing.h"
+
+#define MAX_CONNS 4096
+
+/* Longest command of a trace, and longest response header */
+#define CMD_MAX 1024
+#define HEADER_MAX 4096
+
+typedef enum {
+    RESP_HEADER,     /* Status line and headers */
+    RESP_LENGTH,     /* Body of Content-Length bytes */
+    RESP_CHUNK_SIZE, /* Size line of the next chunk */
+    RESP_CHUNK_DATA, /* Data of a chunk, then its CRLF */
+    RESP_TRAILER,    /* Lines after the last chunk */
+    RESP_CLOSE,      /* Body ended by closing the connection */
+} resp_state_t;
+
+typedef struct {
+    int fd;
+    bool connecting;
+    bool keep_alive; /* Whether the connection outlives the response */
+    int req;         /* Request being sent */
+    size_t req_sent;
+    int64_t start_ns;
+    resp_state_t state;
+    size_t left;           /* Bytes of body or chunk still to come */
+    char line[HEADER_MAX]; /* Header, or line, being read */
+    size_t line_len;
+} client_t;
+
+/* Options */
+static int port = 9999;
+static int nconns = 1;
+static long nrequests = 10000;
+static bool keep_alive = false;
+
+/* Requests for the commands of the trace, replayed in turn */
+static char **requests = NULL;
+static size_t *request_lens = NULL;
+static int ncmds = 0;
+
+static event_loop_t *loop;
+static client_t *clients;
+static int active = 0;
+static long sent = 0, done = 0, failed = 0;
+static int64_t *latencies;
+
+/* Write cmd as the path of a request, with spaces as '/' */
+static size_t encode_path(char *buf, const char *cmd)
+{
+    static const char hex[] = "0123456789ABCDEF";
+    size_t n = 0;
+    buf[n++] = '/';
+    for (const unsigned char *s = (const unsigned char *) cmd; *s; s++) {
+        if (*s == ' ' || *s == '\t') {
+            /* Runs of spaces separate arguments just as well */
+            if (buf[n - 1] != '/')
+                buf[n++] = '/';
+        } else if (*s < ' ' || *s >= 0x7f || strchr("%?#/\"", *s)) {
+            buf[n++] = '%';
+            buf[n++] = hex[*s >> 4];
+            buf[n++] = hex[*s & 15];
+        } else {
+            buf[n++] = *s;
+        }
+    }
+    if (n > 1 && buf[n - 1] == '/')
+        n--;
+    return n;
+}
+
+static bool add_request(const char *cmd)
+{
+    char req[3 * CMD_MAX + 256];
+    size_t n = sprintf(req, "GET ");
+    n += encode_path(req + n, cmd);
+    n += sprintf(req + n,
+                 " HTTP/1.1\r\nHost: localhost:%d\r\nConnection: %s\r\n\r\n",
+                 port, keep_alive ? "keep-alive" : "close");
+
+    char **r = realloc(requests, (ncmds + 1) * sizeof(char *));
+    if (!r)
+        return false;
+    requests = r;
+    size_t *l = realloc(request_lens, (ncmds + 1) * sizeof(size_t));
+    if (!l)
+        return false;
+    request_lens = l;
+    if (!(requests[ncmds] = strdup(req)))
+        return false;
+    request_lens[ncmds++] = n;
+    return true;
+}
+
+/* Turn the commands of the trace file into requests */
+static bool load_trace(const char *fname)
+{
+    FILE *f = fopen(fname, "r");
+    if (!f) {
+        perror(fname);
+        return false;
+    }
+
+    char line[CMD_MAX];
+    bool ok = true;
+    while (ok && fgets(line, sizeof(line), f)) {
+        line[strcspn(line, "\r\n")] = '\0';
+        char *cmd = line + strspn(line, " \t");
+        if (!*cmd || *cmd == '#')
+            continue;
+        /* Commands that would stop the server or read its terminal */
+        size_t len = strcspn(cmd, " \t");
+        if ((len == 4 && !strncmp(cmd, "quit", 4)) ||
+            (len == 3 && !strncmp(cmd, "web", 3)) ||
+            (len == 6 && !strncmp(cmd, "source", 6))) {
+            fprintf(stderr, "Skipping '%s'\n", cmd);
+            continue;
+        }
+        ok = add_request(cmd);
+    }
+    fclose(f);
+
+    if (!ok)
+        fprintf(stderr, "Out of memory\n");
+    else if (!ncmds)
+        fprintf(stderr, "No commands in '%s'\n", fname);
+    return ok && ncmds > 0;
+}
+
+static void client_ready(int fd, int events, void *arg);
+
+static void client_close(client_t *c)
+{
+    event_del(loop, c->fd);
+    close(c->fd);
+    c->fd = -1;
+}
+
+static void client_connect(client_t *c)
+{
+    c->fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (c->fd < 0) {
+        perror("socket");
+        exit(1);
+    }
+    fcntl(c->fd, F_SETFL, fcntl(c->fd, F_GETFL) | O_NONBLOCK);
+    int on = 1;
+    setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+
+    struct sockaddr_in addr = {
+        .sin_family = AF_INET,
+        .sin_port = htons(port),
+        .sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+    };
+    if (connect(c->fd, (struct sockaddr *) &addr, sizeof(addr)) < 0 &&
+        errno != EINPROGRESS) {
+        perror("connect");
+        exit(1);
+    }
+    c->connecting = true;
+}
+
+/* Send the next request, over a new connection unless kept alive */
+static void client_next(client_t *c)
+{
+    if (sent == nrequests) {
+        if (c->fd >= 0)
+            client_close(c);
+        active--;
+        return;
+    }
+
+    c->req = sent++ % ncmds;
+    c->req_sent = 0;
+    c->state = RESP_HEADER;
+    c->line_len = 0;
+    c->start_ns = timing_ns();
+    if (c->fd < 0)
+        client_connect(c);
+    event_add(loop, c->fd, EVENT_WRITE, client_ready, c);
+}
+
+static void client_done(client_t *c, bool ok)
+{
+    if (ok)
+        latencies[done++] = timing_ns() - c->start_ns;
+    else
+        failed++;
+    if (!ok || !c->keep_alive)
+        client_close(c);
+    client_next(c);
+}
+
+/* Append the line at *p to c->line.  Return false if it is incomplete */
+static bool take_line(client_t *c, const char **p, const char *end)
+{
+    const char *nl = memchr(*p, '\n', end - *p);
+    size_t n = (nl ? nl + 1 : end) - *p;
+    if (c->line_len + n >= HEADER_MAX)
+        n = HEADER_MAX - 1 - c->line_len;
+    memcpy(c->line + c->line_len, *p, n);
+    c->line_len += n;
+    c->line[c->line_len] = '\0';
+    *p = nl ? nl + 1 : end;
+    return nl != NULL;
+}
+
+static bool header_complete(const client_t *c)
+{
+    size_t n = c->line_len;
+    return (n >= 2 && !strcmp(c->line + n - 2, "\n\n")) ||
+           (n >= 4 && !strcmp(c->line + n - 4, "\r\n\r\n"));
+}
+
+/* Find how the body is delimited from the header in c->line */
+static void parse_header(client_t *c)
+{
+    c->state = RESP_CLOSE;
+    c->keep_alive = keep_alive;
+    for (const char *l = strchr(c->line, '\n'); l; l = strchr(l, '\n')) {
+        l++;
+        if (!strncasecmp(l, "Content-Length:", 15)) {
+            c->state = RESP_LENGTH;
+            c->left = strtoul(l + 15, NULL, 10);
+        } else if (!strncasecmp(l, "Transfer-Encoding:", 18)) {
+            c->state = RESP_CHUNK_SIZE;
+        } else if (!strncasecmp(l, "Connection:", 11)) {
+            l += 11 + strspn(l + 11, " ");
+            c->keep_alive &= !strncasecmp(l, "keep-alive", 10);
+        }
+    }
+    /* Otherwise only closing the connection ends the body */
+    if (c->state == RESP_CLOSE)
+        c->keep_alive = false;
+    c->line_len = 0;
+}
+
+/* Follow the response through the bytes received.
+ * Return 1 once it is complete, 0 if more is to come, or -1 if malformed.
+ */
+static int parse_response(client_t *c, const char *p, const char *end)
+{
+    while (p < end) {
+        size_t n;
+        switch (c->state) {
+        case RESP_HEADER:
+            /* The header is gathered whole, then parsed at once */
+            if (!take_line(c, &p, end))
+                break;
+            if (c->line_len >= HEADER_MAX - 1)
+                return -1;
+            if (header_complete(c))
+                parse_header(c);
+            if (c->state == RESP_LENGTH && !c->left)
+                return 1;
+            break;
+        case RESP_LENGTH:
+        case RESP_CHUNK_DATA:
+            n = (size_t) (end - p) < c->left ? (size_t) (end - p) : c->left;
+            p += n;
+            c->left -= n;
+            if (c->left)
+                break;
+            if (c->state == RESP_LENGTH)
+                return 1;
+            c->state = RESP_CHUNK_SIZE;
+            break;
+        case RESP_CHUNK_SIZE:
+            if (!take_line(c, &p, end))
+                break;
+            c->left = strtoul(c->line, NULL, 16);
+            c->line_len = 0;
+            /* The data of a chunk is followed by CRLF */
+            c->state = c->left ? RESP_CHUNK_DATA : RESP_TRAILER;
+            c->left += c->left ? 2 : 0;
+            break;
+        case RESP_TRAILER:
+            if (!take_line(c, &p, end))
+                break;
+            if (!strcmp(c->line, "\r\n") || !strcmp(c->line, "\n"))
+                return 1;
+            c->line_len = 0;
+            break;
+        case RESP_CLOSE:
+            p = end;
+            break;
+        }
+    }
+    return 0;
+}
+
+static void client_read(client_t *c)
+{
+    char buf[65536];
+    for (;;) {
+        ssize_t n = recv(c->fd, buf, sizeof(buf), 0);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return;
+        if (n <= 0) {
+            /* Only such a body may be ended by the connection */
+            client_done(c, n == 0 && c->state == RESP_CLOSE);
+            return;
+        }
+
+        int ret = parse_response(c, buf, buf + n);
+        if (ret) {
+            client_done(c, ret > 0);
+            return;
+        }
+    }
+}
+
+static void client_write(client_t *c)
+{
+    const char *req = requests[c->req];
+    size_t len = request_lens[c->req];
+    while (c->req_sent < len) {
+        ssize_t n = send(c->fd, req + c->req_sent, len - c->req_sent,
+                         MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return;
+        if (n < 0) {
+            client_done(c, false);
+            return;
+        }
+        c->req_sent += n;
+    }
+    event_add(loop, c->fd, EVENT_READ, client_ready, c);
+}
+
+static void client_ready(int fd, int events, void *arg)
+{
+    client_t *c = arg;
+    if (c->connecting) {
+        int err = 0;
+        socklen_t len = sizeof(err);
+        getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len);
+        if (err) {
+            fprintf(stderr, "connect: %s\n", strerror(err));
+            exit(1);
+        }
+        c->connecting = false;
+    }
+
+    if (events & EVENT_WRITE)
+        client_write(c);
+    else
+        client_read(c);
+}
+
+static int cmp_ns(const void *a, const void *b)
+{
+    int64_t x = *(const int64_t *) a, y = *(const int64_t *) b;
+    return (x > y) - (x < y);
+}
+
+/* Latency below which pct percent of the requests completed, in ms */
+static double percentile_ms(double pct)
+{
+    long i = (long) (pct / 100 * done);
+    if (i >= done)
+        i = done - 1;
+    return latencies[i] / 1e6;
+}
+
+static void usage(char *cmd)
+{
+    printf("Usage: %s [-h] [-p PORT] [-c CONNS] [-n REQUESTS] [-k] TRACE\n",
+           cmd);
+    printf("\t-h\t\tPrint this information\n");
+    printf("\t-p PORT\t\tPort qtest serves with 'web' (default 9999)\n");
+    printf("\t-c CONNS\tNumber of concurrent connections (default 1)\n");
+    printf("\t-n REQUESTS\tNumber of requests (default 10000)\n");
+    printf("\t-k\t\tKeep connections alive across requests\n");
+    printf("The commands of TRACE are requested in turn, over and over.\n");
+}
+
+int main(int argc, char *argv[])
+{
+    int c;
+    while ((c = getopt(argc, argv, "hp:c:n:k")) != -1) {
+        switch (c) {
+        case 'p':
+            port = atoi(optarg);
+            break;
+        case 'c':
+            nconns = atoi(optarg);
+            break;
+        case 'n':
+            nrequests = atol(optarg);
+            break;
+        case 'k':
+            keep_alive = true;
+            break;
+        default:
+            usage(argv[0]);
+            return c == 'h' ? 0 : 1;
+        }
+    }
+    if (optind != argc - 1 || nconns < 1 || nconns > MAX_CONNS ||
+        nrequests < 1) {
+        usage(argv[0]);
+        return 1;
+    }
+    if (!load_trace(argv[optind]))
+        return 1;
+
+    timing_init();
+    loop = event_loop_new();
+    clients = calloc(nconns, sizeof(client_t));
+    latencies = malloc(nrequests * sizeof(int64_t));
+    if (!loop || !clients || !latencies) {
+        fprintf(stderr, "Out of memory\n");
+        return 1;
+    }
+
+    int64_t start = timing_ns();
+    for (int i = 0; i < nconns; i++) {
+        clients[i].fd = -1;
+        active++;
+        client_next(&clients[i]);
+    }
+    while (active > 0) {
+        if (event_run_once(loop, -1) < 0 && errno != EINTR) {
+            perror("event_run_once");
+            return 1;
+        }
+    }
+    double elapsed = (timing_ns() - start) / 1e9;
+
+    printf("%ld requests over %d%s connections in %.3f s: %.0f requests/s\n",
+           done, nconns, keep_alive ? " kept-alive" : "", elapsed,
+           done / elapsed);
+    if (failed)
+        printf("%ld requests failed\n", failed);
+    if (done) {
+        qsort(latencies, done, sizeof(int64_t), cmp_ns);
+        printf("Latency (ms): p50 %.3f, p99 %.3f, p999 %.3f, max %.3f\n",
+               percentile_ms(50), percentile_ms(99), percentile_ms(99.9),
+               latencies[done - 1] / 1e6);
+    }
+    event_loop_free(loop);
+    return failed ? 1 : 0;
+}